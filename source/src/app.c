@@ -480,6 +480,17 @@ static void set_dp_data(const dp_def_t *dpdef, const u8 *data, u16 datalen)
 	}
 }
 
+// DP used by the device DP table (MCU serial: large DP reports are compacted to these DPs)
+u8 app_dp_is_mapped(u8 dpid, u8 dptype)
+{
+	if (app_device_type != DEVICETYPE_SGS01)   return 1; // unknown device: all DPs (log)
+	for (u8 u=0; sgs01_dp_def[u].dpid; u++)
+	{
+		if (sgs01_dp_def[u].dpid == dpid && sgs01_dp_def[u].dptype == dptype)   return 1;
+	}
+	return 0;
+}
+
 #if (APP_DPDATA_LOG_EN)
 static void DEBUG_DPDATA(const u8 *data, u16 datalen)
 {
@@ -532,6 +543,7 @@ void app_notify(u8 evt, const u8 *data, u16 datalen)
 		    DEBUGSTR(APP_LOG_EN, "|APP] Factory Reset");
 			app_ble_device_disconnect();
 			app_config_reset(); // first
+			app_ble_setup_datafilter();
 			#if (APP_BLE_ATT)
 			app_ble_att_setup_config(); // set new config values
 			#endif
@@ -549,6 +561,9 @@ void app_notify(u8 evt, const u8 *data, u16 datalen)
 		    if (app_state == APP_STATE_CONNPAIR && state_new==0 && state_old!=0)
 		    	app_state_clock = app_sec_time(); // hold conn state on disconnect
 		} break;
+		case APP_NOTIFY_MCUVERSION: // data: soft_ver[3], hard_ver[3]
+			app_ble_set_mcu_version(data, datalen);
+			break;
 		case APP_NOTIFY_BUTTONPRESS:
 		    DEBUGSTR(APP_LOG_EN, "|APP] Button press");
 		    app_set_state(APP_STATE_TOOGLE);
@@ -54,6 +54,7 @@ enum { // subset of used value types
 	VT_BINARY_BATTERY = 0x15, // false = normal, true = low
 	VT_BINARY_PROBLEM = 0x26, // false = ok, true = problemlow
 	VT_TEXT = 0x53, // textlen, ascii text
+	VT_FIRMWARE_VERSION = 0xF2, // patch, minor, major
 	VT_NONE = 0xFF
 };
 
@@ -70,8 +71,9 @@ u32 app_sec_time(void); // seconds timer for longer intervals
 bool app_sec_time_exceeds(u32 ref, u32 sec);
 enum { APP_NOTIFY_NONE=0, APP_NOTIFY_DPDATA, APP_NOTIFY_PRODUCTID, APP_NOTIFY_BATTERYVOLTAGE, APP_NOTIFY_BATTERYLOW,
 	   APP_NOTIFY_FACTORYRESET, APP_NOTIFY_REBOOT,
-	   APP_NOTIFY_CONNSTATE, APP_NOTIFY_BUTTONPRESS };
+	   APP_NOTIFY_CONNSTATE, APP_NOTIFY_BUTTONPRESS, APP_NOTIFY_MCUVERSION };
 void app_notify(u8 evt, const u8 *data, u16 datalen);
+u8 app_dp_is_mapped(u8 dpid, u8 dptype); // DP used by the device DP table
 
 // app_debug.c
 void app_debug_init(void);
@@ -122,12 +124,40 @@ u8 app_config_create_key(const u8 *randbase);
 void app_config_delete_key(void);
 signed char app_config_get_power_level(void);
 void app_config_set_power_level(signed char level_dbm);
-enum {DEVMODE_DEFAULT=0, DEVMODE_MEASURE_NOCONN=0, DEVMODE_MEASURE_CONN, DEVMODE_LAST};
+#define APP_TXCAL_NONE 127 // not calibrated
+signed char app_config_get_txcal_level(void); // calibrated adv power level (dbm)
+void app_config_set_txcal_level(signed char level_dbm);
+enum {DEVMODE_DEFAULT=0, DEVMODE_MEASURE_NOCONN=0, DEVMODE_MEASURE_CONN, DEVMODE_MEASURE_TRIGGER,
+	  DEVMODE_MEASURE_PUSH, // connect to the bonded gateway on data change, notify, disconnect
+#if (BLE_EXT_ADV_CODED_ENABLE)
+	  DEVMODE_MEASURE_CODED, // extended adv on LE Coded PHY (long range, module selected at boot: reboot on mode change)
+#endif
+	  DEVMODE_LAST};
 void app_config_set_mode(u8 mode);
 u8 app_config_get_mode(void);
-enum {DATAFORMAT_DEFAULT=0, DATAFORMAT_BTHOME_V1=1, DATAFORMAT_BTHOME_V2=2, DATAFORMAT_XIAOMI=4};
+enum {DATAFORMAT_DEFAULT=0, DATAFORMAT_BTHOME_V1=1, DATAFORMAT_BTHOME_V2=2, DATAFORMAT_XIAOMI=4,
+	  DATAFORMAT_MIXED=DATAFORMAT_BTHOME_V2|DATAFORMAT_XIAOMI, // alternating adv events (ratio: ADVOPT_MIXRATIO)
+	  DATAFORMAT_MASK=0x07, DATAFORMAT_OPT_MINIMAL=0x08}; // option: minimal airtime (non-connectable)
 void app_config_set_dataformat(u8 mode);
 u8 app_config_get_dataformat(void);
+enum {SENSOR_OBJ_BAT=0, SENSOR_OBJ_TEMP, SENSOR_OBJ_VOLT, SENSOR_OBJ_MOIST, SENSOR_OBJ_CNT};
+typedef struct _attribute_packed_ { u16 abs; u8 rel; u8 hold; } sensor_filter_t; // deadband: abs. (value units), rel. (0.1%), hold time (sec)
+void app_config_get_datafilter(sensor_filter_t *filter); // SENSOR_OBJ_CNT entries
+void app_config_set_datafilter(const sensor_filter_t *filter);
+#define SENSOR_CADENCE_EVERY	0x7F // send object every n-th adv event (0, 1: every event)
+#define SENSOR_CADENCE_ONCHANGE	0x80 // and if changed
+void app_config_get_datacadence(u8 *cadence); // SENSOR_OBJ_CNT entries
+void app_config_set_datacadence(const u8 *cadence);
+enum {ADVOPT_CHANNELS=0, ADVOPT_SCANRSP, ADVOPT_CODING, ADVOPT_MIXRATIO, ADVOPT_CNT=4}; // mix ratio: BTHome events per Xiaomi event (0: 1)
+enum {ADV_CHANNELS_ALL=0, ADV_CHANNELS_ROTATE1, ADV_CHANNELS_ROTATE2, ADV_CHANNELS_LAST};
+enum {ADV_SCANRSP_DEFAULT=0, ADV_SCANRSP_NAME, ADV_SCANRSP_DATA, ADV_SCANRSP_LAST}; // sensor data: no scan response if non-connectable / scannable with name / name + voltage, firmware version (BTHome V2 not encrypted)
+enum {ADV_CODING_S8=0, ADV_CODING_S2, ADV_CODING_LAST}; // DEVMODE_MEASURE_CODED: S8 (max. range) / S2
+void app_config_get_advoptions(u8 *opt); // ADVOPT_CNT bytes
+void app_config_set_advoptions(const u8 *opt);
+u8 app_config_get_advoption(u8 idx);
+#define APP_FLASH_COUNTER_BLOCK 4096 // counter values reserved per flash write
+u32 app_flash_counter_init(void); // returns next counter value
+u32 app_flash_counter_reserve(u32 cnt); // returns end of reserved range (cnt < end)
 
 // app_battery.c
 #if (APP_BATTERY_CHECK)
@@ -156,6 +186,8 @@ enum {BLE_ADV_MODE_None=0, BLE_ADV_MODE_Conn, BLE_ADV_MODE_SensorData };
 void app_ble_setup_adv(u8 adv_mode);
 int app_ble_set_sensor_data(u8 vt, int val, char digits);
 void app_ble_set_sensor_data_changed(void);
+void app_ble_set_mcu_version(const u8 *ver, u16 len);
+void app_ble_setup_datafilter(void);
 void app_ble_set_powerlevel(signed char level_dbm);
 
 // app_att.c
@@ -166,7 +198,9 @@ void app_ble_att_init(void);
 u8 app_ble_att_get_factoryreset(u8 newval);
 void app_ble_att_set_battery_data(u8 level);
 void app_ble_att_set_bthome_data(const u8 *data, u8 len);
+u8 app_ble_att_push_bthome_data(void);
 void app_ble_att_set_xiaomi_data(const u8 *data, u8 len);
+void app_ble_att_set_statistics(u32 advevents, u32 scanrsp);
 #endif
 
 // app_serial_mcu.c
@@ -178,6 +212,7 @@ void app_serial_init_normal(void);
 void app_serial_init_deepRetn(void);
 u8 app_serial_loop(void);
 u8 app_serial_rxtx_busy(void);
+_attribute_ram_code_ void app_serial_irq_handler(void);
 enum {
 	MCU_CMD_SEQ_NONE=0, MCU_CMD_SEQ_INIT, MCU_CMD_SEQ_START_MEASURE,
 	MCU_CMD_SEQ_START_CONNECT, MCU_CMD_SEQ_UPDATE_CONNECT,
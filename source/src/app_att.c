@@ -154,6 +154,22 @@ typedef enum
 	OTA_CMD_INPUT_CCB_H,					// UUID: 2902, 	VALUE: otaDataCCC
 	OTA_CMD_OUT_DESC_H,						// UUID: 2901, 	VALUE: otaName "OTA"
 	#endif
+	// Custom Device Configuration (extension, after OTA to keep the handles above)
+	#if (BLE_ATT_CUSTOMCONFIG)
+	CustomConfigExt_PS_H,					// service
+	CustomConfig_DataFilter_CD_H,			// prop
+	CustomConfig_DataFilter_DP_H,			// value
+	CustomConfig_DataFilter_DESC_H,			// desc
+	CustomConfig_AdvOptions_CD_H,			// prop
+	CustomConfig_AdvOptions_DP_H,			// value
+	CustomConfig_AdvOptions_DESC_H,			// desc
+	CustomConfig_Statistics_CD_H,			// prop
+	CustomConfig_Statistics_DP_H,			// value
+	CustomConfig_Statistics_DESC_H,			// desc
+	CustomConfig_DataCadence_CD_H,			// prop
+	CustomConfig_DataCadence_DP_H,			// value
+	CustomConfig_DataCadence_DESC_H,		// desc
+	#endif
 	ATT_END_H,
 } ATT_HANDLE;
 
@@ -321,16 +337,27 @@ static const u8 att_batCharVal_def[5] = {
 //   Att EncryptKey:   eb0fb41b-af4b-4724-a6f9-974f55aba81a
 //   Att PowerLevel:   0x2A07
 //   Att DeviceMode:   9546a800-d32e-4573-81e1-d597c5e1da74
-//   Att DeviceMode:   9546a801-d32e-4573-81e1-d597c5e1da74
+//   Att DataFormat:   9546a801-d32e-4573-81e1-d597c5e1da74
 //   Att BTHome data:  d52246df-98ac-4d21-be1b-70d5f66a5ddb
 //   Att FactoryReset: b0a7e40f-2b87-49db-801c-eb3686a24bdb
+// Custom configuration extension (after the OTA service)
+//  Service: 9546a8ff-d32e-4573-81e1-d597c5e1da74
+//   Att DataFilter:   9546a802-d32e-4573-81e1-d597c5e1da74
+//   Att AdvOptions:   9546a803-d32e-4573-81e1-d597c5e1da74
+//   Att Statistics:   9546a804-d32e-4573-81e1-d597c5e1da74
+//   Att DataCadence:  9546a805-d32e-4573-81e1-d597c5e1da74
 #define CHARACTERISTIC_UUID_POWER_LEVEL	0x2A07
 
 #define CUSTOM_SERVICE_UUID 0x25,0x12,0xB5,0xCB,0xD4,0x60,0x80,0x0C,0x15,0xC3,0x9B,0xA9,0xAC,0x5A,0x8A,0xDE
+#define CUSTOM_EXT_SERVICE_UUID 0x74,0xDA,0xE1,0xC5,0x97,0xD5,0xE1,0x81,0x73,0x45,0x2E,0xD3,0xFF,0xA8,0x46,0x95
 #define CUSTOM_ATT_PINCODE_UUID 0x03,0x6C,0x5F,0x6D,0x94,0x1F,0x89,0x89,0xAE,0x49,0x0C,0x86,0x04,0x71,0xFB,0x0F
 #define CUSTOM_ATT_ENCRYPTKEY_UUID 0x1A,0xA8,0xAB,0x55,0x4F,0x97,0xF9,0xA6,0x24,0x47,0x4B,0xAF,0x1B,0xB4,0x0F,0xEB
 #define CUSTOM_ATT_DEVICEMODE_UUID  0x74,0xDA,0xE1,0xC5,0x97,0xD5,0xE1,0x81,0x73,0x45,0x2E,0xD3,0x00,0xA8,0x46,0x95
 #define CUSTOM_ATT_DATAFORMAT_UUID  0x74,0xDA,0xE1,0xC5,0x97,0xD5,0xE1,0x81,0x73,0x45,0x2E,0xD3,0x01,0xA8,0x46,0x95
+#define CUSTOM_ATT_DATAFILTER_UUID  0x74,0xDA,0xE1,0xC5,0x97,0xD5,0xE1,0x81,0x73,0x45,0x2E,0xD3,0x02,0xA8,0x46,0x95
+#define CUSTOM_ATT_ADVOPTIONS_UUID  0x74,0xDA,0xE1,0xC5,0x97,0xD5,0xE1,0x81,0x73,0x45,0x2E,0xD3,0x03,0xA8,0x46,0x95
+#define CUSTOM_ATT_STATISTICS_UUID  0x74,0xDA,0xE1,0xC5,0x97,0xD5,0xE1,0x81,0x73,0x45,0x2E,0xD3,0x04,0xA8,0x46,0x95
+#define CUSTOM_ATT_DATACADENCE_UUID 0x74,0xDA,0xE1,0xC5,0x97,0xD5,0xE1,0x81,0x73,0x45,0x2E,0xD3,0x05,0xA8,0x46,0x95
 #define CUSTOM_ATT_BTHOMEDATA_UUID 0xDB,0x5D,0x6A,0xF6,0xD5,0x70,0x1B,0xBE,0x21,0x4D,0xAC,0x98,0xDF,0x46,0x22,0xD5
 
 #define CUSTOM_ATT_FACTORYRESET_UUID 0xDB,0x4B,0xA2,0x86,0x36,0xEB,0x1C,0x80,0xDB,0x49,0x87,0x2B,0x0F,0xE4,0xA7,0xB0
@@ -341,6 +368,11 @@ static const u8 att_CustomAttEncryptKeyUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_E
 static const u16 att_CustomAttPowerLevelUUID = CHARACTERISTIC_UUID_POWER_LEVEL;
 static const u8 att_CustomAttDeviceModeUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_DEVICEMODE_UUID);
 static const u8 att_CustomAttDataFormatUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_DATAFORMAT_UUID);
+static const u8 att_CustomExtServiceUUID16[16] = WRAPPING_BRACES(CUSTOM_EXT_SERVICE_UUID);
+static const u8 att_CustomAttDataFilterUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_DATAFILTER_UUID);
+static const u8 att_CustomAttAdvOptionsUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_ADVOPTIONS_UUID);
+static const u8 att_CustomAttStatisticsUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_STATISTICS_UUID);
+static const u8 att_CustomAttDataCadenceUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_DATACADENCE_UUID);
 #endif
 static const u8 att_CustomAttBTHomeDataUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_BTHOMEDATA_UUID);
 static const u8 att_CustomAttFactoryResetUUID16[16] = WRAPPING_BRACES(CUSTOM_ATT_FACTORYRESET_UUID);
@@ -351,6 +383,10 @@ _attribute_data_retention_ static u8 att_customEncryptKey_val[16] = {0,0,0,0,0,0
 _attribute_data_retention_ static u8 att_customPowerLevel_val[1] = {3};
 _attribute_data_retention_ static u8 att_customDeviceMode_val[1] = {0};
 _attribute_data_retention_ static u8 att_customDataFormat_val[1] = {0};
+_attribute_data_retention_ static sensor_filter_t att_customDataFilter_val[SENSOR_OBJ_CNT]; // abs (u16), rel, hold per object
+_attribute_data_retention_ static u8 att_customAdvOptions_val[ADVOPT_CNT] = {0}; // channels, scan response, coded PHY coding, mix ratio
+_attribute_data_retention_ static u8 att_customStatistics_val[8] = {0}; // adv events (u32), scan responses (u32): set on connect
+_attribute_data_retention_ static u8 att_customDataCadence_val[SENSOR_OBJ_CNT] = {0}; // every n-th adv event | on change per object
 #endif
 _attribute_data_retention_ static u8 att_customBTHomeData_val[20];
 _attribute_data_retention_ static u8 att_customBTHomeData_ccc[2] = {0,0};
@@ -361,6 +397,10 @@ static const u8 att_customEncryptKey_desc[]={'E','n','c','r','y','p','t','i','o'
 #if (BLE_ATT_CUSTOMCONFIG)
 static const u8 att_customDeviceMode_desc[]={'D','e','v','i','c','e',' ','M','o','d','e'};
 static const u8 att_customDataFormat_desc[]={'D','a','t','a',' ','F','o','r','m','a','t'};
+static const u8 att_customDataFilter_desc[]={'D','a','t','a',' ','F','i','l','t','e','r'};
+static const u8 att_customAdvOptions_desc[]={'A','d','v',' ','O','p','t','i','o','n','s'};
+static const u8 att_customStatistics_desc[]={'S','t','a','t','i','s','t','i','c','s'};
+static const u8 att_customDataCadence_desc[]={'D','a','t','a',' ','C','a','d','e','n','c','e'};
 #endif
 static const u8 att_customBTHomeData_desc[]={'B','T','H','o','m','e',' ','D','a','t','a'};
 static const u8 att_customFactoryReset_desc[]={'F','a','c','t','o','r','y',' ','R','e','s','e','t'};
@@ -395,6 +435,30 @@ static const u8 att_customDataFormat_def[19] = {
 	U16_LO(CustomConfig_DataFormat_DP_H), U16_HI(CustomConfig_DataFormat_DP_H),
 	CUSTOM_ATT_DATAFORMAT_UUID
 };
+
+static const u8 att_customDataFilter_def[19] = {
+	CHAR_PROP_READ | CHAR_PROP_WRITE_WITHOUT_RSP | CHAR_PROP_WRITE,
+	U16_LO(CustomConfig_DataFilter_DP_H), U16_HI(CustomConfig_DataFilter_DP_H),
+	CUSTOM_ATT_DATAFILTER_UUID
+};
+
+static const u8 att_customAdvOptions_def[19] = {
+	CHAR_PROP_READ | CHAR_PROP_WRITE_WITHOUT_RSP | CHAR_PROP_WRITE,
+	U16_LO(CustomConfig_AdvOptions_DP_H), U16_HI(CustomConfig_AdvOptions_DP_H),
+	CUSTOM_ATT_ADVOPTIONS_UUID
+};
+
+static const u8 att_customStatistics_def[19] = {
+	CHAR_PROP_READ,
+	U16_LO(CustomConfig_Statistics_DP_H), U16_HI(CustomConfig_Statistics_DP_H),
+	CUSTOM_ATT_STATISTICS_UUID
+};
+
+static const u8 att_customDataCadence_def[19] = {
+	CHAR_PROP_READ | CHAR_PROP_WRITE_WITHOUT_RSP | CHAR_PROP_WRITE,
+	U16_LO(CustomConfig_DataCadence_DP_H), U16_HI(CustomConfig_DataCadence_DP_H),
+	CUSTOM_ATT_DATACADENCE_UUID
+};
 #endif
 
 static const u8 att_customBTHomeData_def[19] = {
@@ -479,6 +543,36 @@ static int customConfigWriteCB(void *p)
 	    app_ble_att_set_bthome_data(0, 0);
 	    return 1;
 	}
+	if (att == CustomConfig_DataFilter_DP_H)
+	{
+		if (len != sizeof(att_customDataFilter_val))   return 1;
+	    DEBUGHEXBUF(APP_ATT_LOG_EN, "[ATT] Write DataFilter: %s", data, len);
+	    userActionCB(p); // reset connection timeout
+	    memcpy(att_customDataFilter_val, data, len);
+	    app_config_set_datafilter(att_customDataFilter_val); // update config
+	    app_ble_setup_datafilter();
+	    return 1;
+	}
+	if (att == CustomConfig_AdvOptions_DP_H)
+	{
+		if (len == 0 || len > sizeof(att_customAdvOptions_val))   return 1;
+	    DEBUGHEXBUF(APP_ATT_LOG_EN, "[ATT] Write AdvOptions: %s", data, len);
+	    userActionCB(p); // reset connection timeout
+	    memcpy(att_customAdvOptions_val, data, len); // unchanged options keep their value
+	    app_config_set_advoptions(att_customAdvOptions_val); // update config (used in sensor data mode)
+	    app_config_get_advoptions(att_customAdvOptions_val);
+	    return 1;
+	}
+	if (att == CustomConfig_DataCadence_DP_H)
+	{
+		if (len != sizeof(att_customDataCadence_val))   return 1;
+	    DEBUGHEXBUF(APP_ATT_LOG_EN, "[ATT] Write DataCadence: %s", data, len);
+	    userActionCB(p); // reset connection timeout
+	    memcpy(att_customDataCadence_val, data, len);
+	    app_config_set_datacadence(att_customDataCadence_val); // update config
+	    app_ble_setup_datafilter();
+	    return 1;
+	}
 	#endif
 	if (att == CustomConfig_FactoryReset_DP_H)
 	{
@@ -521,6 +615,12 @@ void app_ble_att_setup_config(void)
 	    DEBUGFMT(APP_ATT_LOG_EN, "[ATT] Setup DeviceMode %u", mode);
 		u8 datafmt=app_config_get_dataformat(); att_customDataFormat_val[0]=datafmt;
 	    DEBUGFMT(APP_ATT_LOG_EN, "[ATT] Setup DataFormat %u", datafmt);
+		app_config_get_datafilter(att_customDataFilter_val);
+	    DEBUGHEXBUF(APP_ATT_LOG_EN, "[ATT] Setup DataFilter %s", att_customDataFilter_val, sizeof(att_customDataFilter_val));
+		app_config_get_advoptions(att_customAdvOptions_val);
+	    DEBUGHEXBUF(APP_ATT_LOG_EN, "[ATT] Setup AdvOptions %s", att_customAdvOptions_val, sizeof(att_customAdvOptions_val));
+		app_config_get_datacadence(att_customDataCadence_val);
+	    DEBUGHEXBUF(APP_ATT_LOG_EN, "[ATT] Setup DataCadence %s", att_customDataCadence_val, sizeof(att_customDataCadence_val));
 		#endif
 	}
 	if (security_level==Authenticated_Pairing_with_Encryption)
@@ -595,7 +695,7 @@ _attribute_data_retention_ static attribute_t att_Attributes[] =
 	{0,ATT_PERMISSIONS_READ,2,sizeof(att_bat_val),(u8*)(&att_batCharUUID),(u8*)(att_bat_val),0,0}, // value
 	{0,ATT_PERMISSIONS_RDWR,2,sizeof(att_bat_ccc),(u8*)(&att_clientCharacterCfgUUID),(u8*)(att_bat_ccc),0,0}, // value ccc
     // 0x001D - 0x0032 Custom Configuration Service
-	{22,ATT_PERMISSIONS_READ,2,16,(u8*)(&att_primaryServiceUUID),(u8*)(att_CustomServiceUUID16),0,0},
+	{CustomConfig_FactoryReset_DESC_H-CustomConfig_PS_H+1,ATT_PERMISSIONS_READ,2,16,(u8*)(&att_primaryServiceUUID),(u8*)(att_CustomServiceUUID16),0,0},
 	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customPincode_def),(u8*)(&att_characterUUID),(u8*)(att_customPincode_def),0,0}, // prop
 	{0,ATT_PERMISSIONS_ENCRYPT_RDWR,16,sizeof(att_customPincode_val),(u8*)(att_CustomAttPincodeUUID16),(u8*)(att_customPincode_val),&customConfigWriteCB,0}, // value
 	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customPincode_desc),(u8*)(&att_userdesc_UUID),(u8*)(att_customPincode_desc),0,0}, // desc
@@ -627,6 +727,22 @@ _attribute_data_retention_ static attribute_t att_Attributes[] =
 	{0,ATT_PERMISSIONS_RDWR,2,sizeof(att_otaData_ccc),(u8*)(&att_clientCharacterCfgUUID),(u8*)(att_otaData_ccc),0,0}, // value ccc
 	{0,ATT_PERMISSIONS_READ,2,sizeof (att_otaData_desc),(u8*)(&att_userdesc_UUID),(u8*)(att_otaData_desc),0,0}, // desc
 	#endif
+	// 0x0038 - 0x0044 Custom Configuration Extension Service
+	#if (BLE_ATT_CUSTOMCONFIG)
+	{CustomConfig_DataCadence_DESC_H-CustomConfigExt_PS_H+1,ATT_PERMISSIONS_READ,2,16,(u8*)(&att_primaryServiceUUID),(u8*)(att_CustomExtServiceUUID16),0,0},
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customDataFilter_def),(u8*)(&att_characterUUID),(u8*)(att_customDataFilter_def),0,0}, // prop
+	{0,ATT_PERMISSIONS_ENCRYPT_RDWR,16,sizeof(att_customDataFilter_val),(u8*)(&att_CustomAttDataFilterUUID16),(u8*)(att_customDataFilter_val),&customConfigWriteCB,0}, // value
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customDataFilter_desc),(u8*)(&att_userdesc_UUID),(u8*)(att_customDataFilter_desc),0,0}, // desc
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customAdvOptions_def),(u8*)(&att_characterUUID),(u8*)(att_customAdvOptions_def),0,0}, // prop
+	{0,ATT_PERMISSIONS_ENCRYPT_RDWR,16,sizeof(att_customAdvOptions_val),(u8*)(&att_CustomAttAdvOptionsUUID16),(u8*)(att_customAdvOptions_val),&customConfigWriteCB,0}, // value
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customAdvOptions_desc),(u8*)(&att_userdesc_UUID),(u8*)(att_customAdvOptions_desc),0,0}, // desc
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customStatistics_def),(u8*)(&att_characterUUID),(u8*)(att_customStatistics_def),0,0}, // prop
+	{0,ATT_PERMISSIONS_ENCRYPT_READ,16,sizeof(att_customStatistics_val),(u8*)(&att_CustomAttStatisticsUUID16),(u8*)(att_customStatistics_val),0,0}, // value
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customStatistics_desc),(u8*)(&att_userdesc_UUID),(u8*)(att_customStatistics_desc),0,0}, // desc
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customDataCadence_def),(u8*)(&att_characterUUID),(u8*)(att_customDataCadence_def),0,0}, // prop
+	{0,ATT_PERMISSIONS_ENCRYPT_RDWR,16,sizeof(att_customDataCadence_val),(u8*)(&att_CustomAttDataCadenceUUID16),(u8*)(att_customDataCadence_val),&customConfigWriteCB,0}, // value
+	{0,ATT_PERMISSIONS_READ,2,sizeof(att_customDataCadence_desc),(u8*)(&att_userdesc_UUID),(u8*)(att_customDataCadence_desc),0,0}, // desc
+	#endif
 };
 
 // Init attribute table
@@ -656,11 +772,27 @@ void app_ble_att_set_bthome_data(const u8 *data, u8 len)
 		bls_att_pushNotifyData(CustomConfig_BTHomeData_DP_H, att_customBTHomeData_val, len);
 }
 
+// notify current BTHome data (push mode), returns 1 if sent
+u8 app_ble_att_push_bthome_data(void)
+{
+	u8 len=att_Attributes[CustomConfig_BTHomeData_DP_H].attrLen;
+	if (len == 0 || !val_in_ccc(att_customBTHomeData_ccc))   return 0;
+	return bls_att_pushNotifyData(CustomConfig_BTHomeData_DP_H, att_customBTHomeData_val, len) == BLE_SUCCESS;
+}
+
 void app_ble_att_set_xiaomi_data(const u8 *data, u8 len)
 {
 	att_Attributes[CustomConfig_BTHomeData_DP_H].attrLen = 0;
 }
 
+void app_ble_att_set_statistics(u32 advevents, u32 scanrsp)
+{
+	#if (BLE_ATT_CUSTOMCONFIG)
+	set_u32(att_customStatistics_val, advevents);
+	set_u32(att_customStatistics_val+4, scanrsp);
+	#endif
+}
+
 
 #endif // #if (APP_BLE_ATT)  // component enabled
 
@@ -51,6 +51,72 @@
 #ifndef BLE_OTA_SERVER_ENABLE
 #define BLE_OTA_SERVER_ENABLE 0
 #endif
+#ifndef APP_BTHOME_LOG_EN
+#define APP_BTHOME_LOG_EN 0
+#endif
+#ifndef APP_CCM_DEBUG_EN
+#define APP_CCM_DEBUG_EN 0
+#endif
+#ifndef SENSORDATA_ADV_ADAPTIVE
+#define SENSORDATA_ADV_ADAPTIVE 0
+#endif
+#ifndef SENSORDATA_ADV_INTERVAL_FAST
+#define SENSORDATA_ADV_INTERVAL_FAST (ADV_INTERVAL_1S / 5)
+#endif
+#ifndef SENSORDATA_ADV_FAST_EVENTS
+#define SENSORDATA_ADV_FAST_EVENTS 10
+#endif
+#ifndef SENSORDATA_ADV_BACKOFF_EVENTS
+#define SENSORDATA_ADV_BACKOFF_EVENTS 3
+#endif
+#ifndef SENSORDATA_TRIGGER_ADV_INTERVAL
+#define SENSORDATA_TRIGGER_ADV_INTERVAL (ADV_INTERVAL_1S / 10)
+#endif
+#ifndef SENSORDATA_TRIGGER_EVENTS
+#define SENSORDATA_TRIGGER_EVENTS 8
+#endif
+#ifndef SENSORDATA_TRIGGER_HEARTBEAT_SEC
+#define SENSORDATA_TRIGGER_HEARTBEAT_SEC (10*60)
+#endif
+#ifndef SENSORDATA_TRIGGER_WAKEUP_SEC
+#define SENSORDATA_TRIGGER_WAKEUP_SEC 60
+#endif
+#ifndef SENSORDATA_PUSH_ADV_MS
+#define SENSORDATA_PUSH_ADV_MS 1280
+#endif
+#ifndef SENSORDATA_PUSH_CONN_MS
+#define SENSORDATA_PUSH_CONN_MS 3000
+#endif
+#ifndef SENSORDATA_PUSH_HEARTBEAT_SEC
+#define SENSORDATA_PUSH_HEARTBEAT_SEC (30*60)
+#endif
+#ifndef SENSORDATA_ADV_SPREAD
+#define SENSORDATA_ADV_SPREAD 0
+#endif
+#ifndef SENSORDATA_ADV_JITTER_PCT
+#define SENSORDATA_ADV_JITTER_PCT 10
+#endif
+#ifndef SENSORDATA_MINIMAL_SLOW_CNT
+#define SENSORDATA_MINIMAL_SLOW_CNT 8
+#endif
+#ifndef BLE_TXPOWER_CALIBRATION
+#define BLE_TXPOWER_CALIBRATION 0
+#endif
+#ifndef BLE_EXT_ADV_CODED_ENABLE
+#define BLE_EXT_ADV_CODED_ENABLE 0
+#endif
+#ifndef SENSORDATA_DEVINFO_EVENTS
+#define SENSORDATA_DEVINFO_EVENTS 0
+#endif
+#ifndef SENSORDATA_DEVINFO_SEC
+#define SENSORDATA_DEVINFO_SEC 0
+#endif
+#ifndef BTHOME_ENCRYPT_PER_EVENT
+#define BTHOME_ENCRYPT_PER_EVENT 0
+#endif
+#ifndef BTHOME_ENCRYPT_EVENT_BUDGET_US
+#define BTHOME_ENCRYPT_EVENT_BUDGET_US 300
+#endif
 
 // Connection mode
 #define 	BLE_CONN_ADV_INTERVAL_MIN			ADV_INTERVAL_30MS
@@ -82,18 +148,23 @@ enum { DATA_FLAG_PID=0x01, DATA_FLAG_BAT=0x02,
 	   DATA_FLAG_MOIST=0x10,
 	   DATA_FLAG_CHANGED=0x080,
 	   DATA_FLAGS_DATAVALID=0x7F,
+	   DATA_FLAGS_SLOW=DATA_FLAG_VOLT, // minimal airtime: only if updated or every n-th packet
 };
 
-_attribute_data_retention_ struct {
+typedef struct {
 	u8    flags;
 	u8    pid; 				// VT_PID VD_UINT digits=0
 	u8    batterypercent;	// VT_BATTERY_PERCENT VD_UINT digits=0
 	short temperature;		// VT_TEMPERATURE VD_INT digits=2
 	u16   voltage;			// VT_VOLTAGE VD_UINT digits=3
 	u16   moisture;			// VT_MOISTURE VD_UINT digits=2
-} sensor_data = {0, 0, 0, 0, 0, 0};
+} sensor_data_t;
+
+_attribute_data_retention_ sensor_data_t sensor_data = {0, 0, 0, 0, 0, 0};
 
+_attribute_data_retention_ u8 sensor_data_updated = 0; // DATA_FLAG_xxx: updated since last build
 _attribute_data_retention_ u32 sensor_data_sendcount = 0;
+_attribute_data_retention_ u32 sensor_data_sendcount_end = 0; // counter reserved in flash (sendcount < end)
 
 void sensordata_increment_packetid()
 {
@@ -114,12 +185,79 @@ static int sensordata_adjust_digits(int val, char digits, char dest_digits)
 	return val;
 }
 
+//
+// Sensor data filter (deadband + min. hold time, before the changed flag is set)
+//
+static const struct { u8 vt; u8 flag; char digits; } sensor_obj_def[SENSOR_OBJ_CNT] = {
+	{VT_BATTERY_PERCENT, DATA_FLAG_BAT, 0}, {VT_TEMPERATURE, DATA_FLAG_TEMP, 2},
+	{VT_VOLTAGE, DATA_FLAG_VOLT, 3}, {VT_MOISTURE, DATA_FLAG_MOIST, 2}
+};
+
+_attribute_data_retention_ sensor_filter_t sensor_filter[SENSOR_OBJ_CNT];
+_attribute_data_retention_ u8 sensor_cadence[SENSOR_OBJ_CNT]; // SENSOR_CADENCE_xxx
+_attribute_data_retention_ u8 sensor_cadence_enabled = 0;
+_attribute_data_retention_ struct {
+	int val;		// pending value (hold time)
+	u32 time;		// last reported (sec)
+	u8  pending;
+} sensor_filter_state[SENSOR_OBJ_CNT];
+
+void app_ble_setup_datafilter(void)
+{
+	app_config_get_datafilter(sensor_filter);
+	app_config_get_datacadence(sensor_cadence);
+	sensor_cadence_enabled=0;
+	for (u8 u=0; u<SENSOR_OBJ_CNT; u++)
+	{
+		if ((sensor_cadence[u]&SENSOR_CADENCE_EVERY) > 1)   sensor_cadence_enabled=1;
+		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] Data filter %u: abs %u rel %u hold %u, cadence 0x%02X", u,
+			sensor_filter[u].abs, sensor_filter[u].rel, sensor_filter[u].hold, sensor_cadence[u]);
+	}
+}
+
+// returns 1: report new value
+static int sensordata_filter(u8 obj, int val, int val_old)
+{
+	const sensor_filter_t *f=&sensor_filter[obj];
+	u8 valid=(sensor_data.flags&sensor_obj_def[obj].flag)!=0;
+	sensor_filter_state[obj].pending=0;
+	if (!valid)
+	{	// first value: start the hold time here (state is 0 after boot)
+		sensor_filter_state[obj].time=app_sec_time();
+	}
+	else
+	{
+		if (val==val_old)   return 0; // no change
+		int diff=abs(val-val_old);
+		if (diff < f->abs)   return 0; // abs. deadband
+		if (f->rel && diff*1000 < abs(val_old)*f->rel)   return 0; // rel. deadband
+		if (f->hold && (app_sec_time()-sensor_filter_state[obj].time) < f->hold)
+		{	// hold time: report later
+			sensor_filter_state[obj].val=val; sensor_filter_state[obj].pending=1;
+			return 0;
+		}
+		sensor_filter_state[obj].time=app_sec_time();
+	}
+	sensor_data_updated|=sensor_obj_def[obj].flag;
+	return 1;
+}
+
+static void sensordata_filter_loop(void)
+{
+	for (u8 u=0; u<SENSOR_OBJ_CNT; u++)
+	{
+		if (!sensor_filter_state[u].pending)   continue;
+		if ((app_sec_time()-sensor_filter_state[u].time) < sensor_filter[u].hold)   continue;
+		app_ble_set_sensor_data(sensor_obj_def[u].vt, sensor_filter_state[u].val, sensor_obj_def[u].digits);
+	}
+}
+
 int app_ble_set_sensor_data(u8 vt, int val, char digits)
 {
 	if (vt==VT_BATTERY_PERCENT) {
 		val=sensordata_adjust_digits(val, digits, 0);
 		if (val<0 || val>100)    return -1;
-		if ((sensor_data.flags&DATA_FLAG_BAT)!=0 && val==sensor_data.batterypercent)   return 0;
+		if (!sensordata_filter(SENSOR_OBJ_BAT, val, sensor_data.batterypercent))   return 0;
 		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] Data battery %u %%", val);
 		sensor_data.batterypercent=(u8)val;
 		sensor_data.flags|=DATA_FLAG_BAT|DATA_FLAG_CHANGED;
@@ -131,7 +269,7 @@ int app_ble_set_sensor_data(u8 vt, int val, char digits)
 	if (vt==VT_TEMPERATURE) {
 		val=sensordata_adjust_digits(val, digits, 2);
 		if (val<INT16_MIN || val>INT16_MAX)    return -1;
-		if ((sensor_data.flags&DATA_FLAG_TEMP)!=0 && val==sensor_data.temperature)   return 0;
+		if (!sensordata_filter(SENSOR_OBJ_TEMP, val, sensor_data.temperature))   return 0;
 		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] Data temperature %d.%02u C", val/100, abs(val)%100);
 		sensor_data.temperature=(short)val;
 		sensor_data.flags|=DATA_FLAG_TEMP|DATA_FLAG_CHANGED;
@@ -140,7 +278,7 @@ int app_ble_set_sensor_data(u8 vt, int val, char digits)
 	if (vt==VT_VOLTAGE) {
 		val=sensordata_adjust_digits(val, digits, 3);
 		if (val<0 || val>UINT16_MAX)    return -1;
-		if ((sensor_data.flags&DATA_FLAG_VOLT)!=0 && val==sensor_data.voltage)   return 0;
+		if (!sensordata_filter(SENSOR_OBJ_VOLT, val, sensor_data.voltage))   return 0;
 		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] Data voltage %d mV", val);
 		sensor_data.voltage=(u16)val;
 		sensor_data.flags|=DATA_FLAG_VOLT|DATA_FLAG_CHANGED;
@@ -149,7 +287,7 @@ int app_ble_set_sensor_data(u8 vt, int val, char digits)
 	if (vt==VT_MOISTURE) {
 		val=sensordata_adjust_digits(val, digits, 2);
 		if (val<0 || val>100*100)    return -1;
-		if ((sensor_data.flags&DATA_FLAG_MOIST)!=0 && val==sensor_data.moisture)   return 0;
+		if (!sensordata_filter(SENSOR_OBJ_MOIST, val, sensor_data.moisture))   return 0;
 		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] Data moisture %d.%02u %%", val/100, abs(val)%100);
 		sensor_data.moisture=(u16)val;
 		sensor_data.flags|=DATA_FLAG_MOIST|DATA_FLAG_CHANGED;
@@ -182,7 +320,9 @@ void app_ble_set_sensor_data_changed(void)
 #define XIAOMI_ADV_FLAG_HASMAC		 0x0010
 #define XIAOMI_ADV_FLAG_HASDATA		 0x0040
 #define XIAOMI_ADV_FLAG_AUTHMODEMASK 0x0C00
+#define XIAOMI_ADV_FLAG_AUTHMODE_V5	 0x0800 // auth mode 2: bindkey (MiBeacon v5)
 #define XIAOMI_ADV_FLAG_VERSIONMASK	 0xF000
+#define XIAOMI_ADV_FLAG_VERSION_V5	 0x5000
 
 _attribute_data_retention_ u8 ble_scanRsp [] = {
 	 13, DT_COMPLETE_LOCAL_NAME,			'U', 'N', 'K', 'W', 'N', '-', '?', '?', '?', '?', '?', '?'
@@ -202,8 +342,73 @@ const u8 ble_advDataError[] = {
 	     VT_TEXT, 5, 'E', 'r', 'r', 'o', 'r'
 };
 
-_attribute_data_retention_ u8 ble_advSensorDataLen = 0;
-_attribute_data_retention_ u8 ble_advSensorData[31]; // max.
+// sensor data payload (double buffered):
+//   app_ble_loop builds into ble_advSensorData, the adv prepare callback swaps it into the adv packet
+#define BLE_ADV_PAYLOAD_MAX 31
+_attribute_data_retention_ u8 ble_adv_payload[2][BLE_ADV_PAYLOAD_MAX];
+_attribute_data_retention_ u8 ble_adv_payload_len[2];
+_attribute_data_retention_ u8 ble_adv_payload_alt[2][BLE_ADV_PAYLOAD_MAX]; // DATAFORMAT_MIXED: Xiaomi payload
+_attribute_data_retention_ u8 ble_adv_payload_alt_len[2]; // 0: none
+_attribute_data_retention_ u8 ble_adv_payload_alt_on = 0; // alternate payload on air
+_attribute_data_retention_ u8 ble_adv_mix_ratio = 0; // BTHome events per alternate event (0: not mixed)
+static u8 ble_adv_build_mixed = 0; // building the alternate payload: packet id and counter of the BTHome frame
+static u32 ble_adv_build_cnt = 0; // counter of the last encrypted BTHome frame
+_attribute_data_retention_ u8 ble_adv_mix_cnt = 0;
+_attribute_data_retention_ u8 ble_adv_payload_idx = 0; // build buffer (the other one is on air)
+_attribute_data_retention_ volatile u8 ble_adv_payload_swap = 0; // build buffer complete: swap at next adv event
+_attribute_data_retention_ u8 *ble_advSensorData = ble_adv_payload[0]; // build buffer
+_attribute_data_retention_ u8 ble_advSensorDataLen = 0; // last built payload
+_attribute_data_retention_ u8 ble_adv_payload_max = BLE_ADV_PAYLOAD_MAX; // build buffer size (ext adv: long payload)
+
+// trigger based adv (DEVMODE_MEASURE_TRIGGER): burst on data change or heartbeat, adv off in between
+enum { ADV_TRIGGER_OFF=0, ADV_TRIGGER_IDLE, ADV_TRIGGER_BURST };
+_attribute_data_retention_ u8 ble_adv_trigger = ADV_TRIGGER_OFF;
+_attribute_data_retention_ u32 ble_adv_trigger_time = 0; // last burst (sec)
+_attribute_data_retention_ u32 ble_adv_trigger_wakeup = 0; // app wakeup tick (adv off)
+
+// push mode (DEVMODE_MEASURE_PUSH): directed adv on data change, notify, disconnect
+enum { ADV_PUSH_OFF=0, ADV_PUSH_IDLE, ADV_PUSH_ADV, ADV_PUSH_CONN, ADV_PUSH_SENT, ADV_PUSH_TERM, ADV_PUSH_DONE };
+_attribute_data_retention_ u8 ble_adv_push = ADV_PUSH_OFF;
+_attribute_data_retention_ u8 ble_adv_push_pending = 0; // data changed during a push
+_attribute_data_retention_ u32 ble_adv_push_tick = 0; // state start (tick)
+_attribute_data_retention_ u32 ble_adv_push_time = 0; // last push (sec)
+_attribute_data_retention_ u32 ble_adv_push_wakeup = 0; // app wakeup tick (adv off)
+
+// minimal airtime (DATAFORMAT_OPT_MINIMAL)
+_attribute_data_retention_ u8 ble_adv_minimal = 0;
+_attribute_data_retention_ u8 ble_adv_connectable = 0; // sensor data adv type
+_attribute_data_retention_ u8 ble_adv_slow_cnt = 0;
+
+// statistics
+_attribute_data_retention_ u32 ble_adv_event_cnt = 0; // sensor data adv events
+_attribute_data_retention_ u32 ble_scanrsp_cnt = 0; // scan requests served (only visible in the GATT statistics after a connect)
+
+// scan response with data (ADV_SCANRSP_DATA): device name + BTHome V2 voltage and firmware version,
+//   rarely needed data out of the primary adv packet (not encrypted: the scan response has no counter)
+_attribute_data_retention_ u8 ble_adv_scanrsp = ADV_SCANRSP_DEFAULT; // sensor data scan response policy
+_attribute_data_retention_ u8 ble_scanRspData[BLE_ADV_PAYLOAD_MAX];
+
+//
+// BTHome encryption on every advertising event:
+//   the prepare callback encrypts the plain data with the current counter,
+//   so each advertising event has its own counter (receivers can drop replays)
+//
+#define BTHOME_CRYPT_MAXDATA	20 // max. plain data length for encryption
+#define BTHOME_CRYPT_OVERHEAD	8  // counter + mic
+
+typedef struct _attribute_packed_ _bthome_event_crypt_t {
+	const u8 *key;	// encryption key (0: disabled)
+	u8 infoflags;	// BTHome info flags (nonce)
+	u8 advlen;		// adv data length (check the packet)
+	u8 ofs;			// data offset in adv data
+	u8 len;			// plain data length
+	u32 ticks;		// encryption time (sys timer ticks): builder (full path), then max. per event
+	u8 data[BTHOME_CRYPT_MAXDATA]; // plain data
+} bthome_event_crypt_t;
+
+// per payload buffer (ble_adv_payload_idx): the build buffer state is switched on air with its payload
+_attribute_data_retention_ bthome_event_crypt_t bthome_event_crypt[2] = {{0}};
+_attribute_data_retention_ u32 bthome_event_crypt_ticks = 0; // max. measured encryption time
 
 static inline u8 hex_digit(u8 h)
 {
@@ -253,6 +458,7 @@ _attribute_optimize_size_ static int ble_build_adv_basic(void)
 {
 	if (ble_advSensorDataLen==3)
 		return 0; // no change
+	bthome_event_crypt[ble_adv_payload_idx].key=0; // new adv data
 	// adv flags
 	u8 u=0;
 	ble_advSensorData[u++]=2; // len
@@ -273,10 +479,292 @@ typedef struct _attribute_packed_ _bthome_nonce_t { // for encryption
 	u32 cnt32;
 } bthome_nonce_t;
 
+#if (BTHOME_ENCRYPT_PER_EVENT)
+// keystream for the next counter value (precomputed in idle time)
+typedef struct _attribute_packed_ _bthome_keystream_t {
+	const u8 *key;	// encryption key (0: not valid)
+	u32 cnt;		// counter (nonce)
+	u8 infoflags;	// BTHome info flags (nonce)
+	u8 len;			// max. plain data length
+	u8 ks[CCM_FAST_KS_LEN]; // tag mask + keystream
+} bthome_keystream_t;
+
+_attribute_data_retention_ bthome_keystream_t bthome_keystream = {0};
+#endif
+
+_attribute_ram_code_ static void ble_bthome_nonce(bthome_nonce_t *nonce, u8 infoflags, u32 cnt)
+{
+	for (u8 m=0; m<6; m++)   nonce->mac[m]=ble_mac_public[5-m];
+	nonce->uuid16=BTHOME_ADV_UUID16; nonce->flags=infoflags; nonce->cnt32=cnt;
+}
+
+// encrypt data and append counter + tag (mic), returns encrypted data length
+_attribute_ram_code_ static u8 ble_bthome_encrypt(const u8 *key, u8 infoflags, u32 cnt, const u8 *data, u8 datalen, u8 *out)
+{
+	bthome_nonce_t nonce; u32 tag;
+	ble_bthome_nonce(&nonce, infoflags, cnt);
+	// encrypt (fixed shape: 13 byte nonce, no add data, 4 byte tag)
+	#if (BTHOME_ENCRYPT_PER_EVENT)
+	bthome_keystream_t *ks=&bthome_keystream;
+	if (ks->key == key && ks->cnt == cnt && ks->infoflags == infoflags && datalen <= ks->len)
+		ccm_encrypt_and_tag_ks(key, (u8 *)&nonce, ks->ks, data, datalen, out, (u8 *)&tag); // CBC-MAC + xor
+	else
+	#endif
+	if (datalen <= CCM_FAST_MAXLEN)
+		ccm_encrypt_and_tag_fast(key, (u8 *)&nonce, data, datalen, out, (u8 *)&tag);
+	else // long payload (ext adv)
+		aes_ccm_encrypt_and_tag(key, (u8 *)&nonce, sizeof(nonce), 0, 0, data, datalen, out, (u8 *)&tag, 4);
+	#if (BTHOME_ENCRYPT_PER_EVENT)
+	ks->key=0; // counter used
+	#endif
+	// append counter + tag (mic)
+	out+=datalen;
+	out[0]=(u8)(cnt&0xFF);  out[1]=(u8)(cnt>>8);  out[2]=(u8)(cnt>>16);  out[3]=(u8)(cnt>>24);
+	out[4]=(u8)(tag&0xFF);  out[5]=(u8)(tag>>8);  out[6]=(u8)(tag>>16);  out[7]=(u8)(tag>>24);
+	return datalen+BTHOME_CRYPT_OVERHEAD;
+}
+
+#if (APP_CCM_DEBUG_EN)
+// CCM fast path vs. generic path: same result, time (sys timer ticks)
+static void ble_bthome_encrypt_benchmark(void)
+{
+	static const u8 key[16]={0x23,0x1d,0x39,0xc1,0xd7,0xcc,0x1a,0xb1,0xae,0xe2,0x24,0xcd,0x09,0x6d,0xb9,0x32};
+	u8 data[BTHOME_CRYPT_MAXDATA], out1[BTHOME_CRYPT_MAXDATA], out2[BTHOME_CRYPT_MAXDATA];
+	u8 nonce[13], tag1[4], tag2[4];
+	for (u8 u=0; u<sizeof(data); u++)   data[u]=u;
+	for (u8 u=0; u<sizeof(nonce); u++)   nonce[u]=0xA0+u;
+	u8 r=irq_disable();
+	u32 t0=clock_time();
+	aes_ccm_encrypt_and_tag(key, nonce, sizeof(nonce), NULL, 0, data, sizeof(data), out1, tag1, 4);
+	u32 t1=clock_time();
+	ccm_encrypt_and_tag_fast(key, nonce, data, sizeof(data), out2, tag2);
+	u32 t2=clock_time();
+	u8 ks[CCM_FAST_KS_LEN];
+	ccm_keystream_fast(key, nonce, sizeof(data), ks);
+	u32 t3=clock_time();
+	ccm_encrypt_and_tag_ks(key, nonce, ks, data, sizeof(data), out1, tag1);
+	u32 t4=clock_time();
+	irq_restore(r);
+	u8 ok=(memcmp(out1, out2, sizeof(out1))==0 && memcmp(tag1, tag2, sizeof(tag1))==0);
+	DEBUGFMT(APP_CCM_DEBUG_EN, "[BLE] CCM %u bytes: generic %u ticks, fast %u ticks (%u us), keystream %u + %u ticks, %s",
+		sizeof(data), t1-t0, t2-t1, (t2-t1)/CLOCK_16M_SYS_TIMER_CLK_1US, t3-t2, t4-t3, ok ? "ok" : "MISMATCH");
+}
+#endif
+
+#if (BTHOME_ENCRYPT_PER_EVENT)
+// precompute the keystream for the next adv event (main loop after the adv event)
+static void ble_bthome_keystream_prepare(void)
+{
+	bthome_keystream_t *ks=&bthome_keystream;
+	u8 r=irq_disable(); // AES engine, counter and payload swap are shared with the adv prepare callback
+	bthome_event_crypt_t *ec=&bthome_event_crypt[ble_adv_payload_swap ? ble_adv_payload_idx : ble_adv_payload_idx^1]; // on air at the next event
+	if (!ec->key)   { irq_restore(r); return; }
+	u32 cnt=sensor_data_sendcount+1;
+	if (ks->key != ec->key || ks->cnt != cnt || ks->infoflags != ec->infoflags || ks->len < ec->len)
+	{
+		bthome_nonce_t nonce;
+		ble_bthome_nonce(&nonce, ec->infoflags, cnt);
+		ccm_keystream_fast(ec->key, (u8 *)&nonce, ec->len, ks->ks);
+		ks->key=ec->key; ks->cnt=cnt; ks->infoflags=ec->infoflags; ks->len=ec->len;
+	}
+	irq_restore(r);
+}
+
+_attribute_ram_code_ static void ble_bthome_encrypt_event(rf_packet_adv_t *p)
+{
+	bthome_event_crypt_t *ec=&bthome_event_crypt[ble_adv_payload_idx^1]; // on air
+	if (p->rf_len != 6+ec->advlen)   return; // other adv data (e.g. error)
+	if (ec->ticks > BTHOME_ENCRYPT_EVENT_BUDGET_US*CLOCK_16M_SYS_TIMER_CLK_1US)
+	{	// last measured time exceeds the budget: no AES here, encrypt only on data changes (main loop)
+		ec->key=0; return;
+	}
+	u32 t=clock_time();
+	ble_bthome_encrypt(ec->key, ec->infoflags, sensor_data_sendcount, ec->data, ec->len, &p->data[ec->ofs]);
+	t=clock_time()-t;
+	if (t > bthome_event_crypt_ticks)   bthome_event_crypt_ticks=t;
+	if (t > ec->ticks)   ec->ticks=t; // checked before the next event
+}
+#endif
+
+//
+// Sensor data objects (table driven encoder)
+//
+#ifndef OFFSETOF
+#define OFFSETOF(s, m) ((unsigned int) &((s *)0)->m)
+#endif
+
+#define ADV_OBJ_SIZEMASK	0x0F // source value size (bytes)
+#define ADV_OBJ_SIGNED		0x80 // source value signed
+#define ADV_OBJ_SRC(m, sign) OFFSETOF(sensor_data_t, m), (sizeof(((sensor_data_t *)0)->m) | (sign))
+
+typedef struct _attribute_packed_ _adv_obj_def_t {
+	u8  flag;	// DATA_FLAG_xxx (0: end of table)
+	u8  ofs;	// value offset in sensor_data
+	u8  type;	// value size | ADV_OBJ_SIGNED
+	u16 id;		// object id (value type)
+	u8  size;	// object value size (bytes)
+	u8  div;	// value divisor (scale)
+} adv_obj_def_t;
+
+enum { ADV_OBJFMT_BTHOME_V1=0, ADV_OBJFMT_BTHOME_V2, ADV_OBJFMT_XIAOMI };
+
 #define BTHOME_V1_DATA_UINT		0x00 // data flag bits 5-7
 #define BTHOME_V1_DATA_INT		0x20
 #define BTHOME_V1_DATA_FLOAT	0x40
 
+// add sensor data objects to adv data, returns new adv data length (<0: length error)
+_attribute_optimize_size_ static int ble_build_adv_objects(const adv_obj_def_t *def, u8 objfmt, u8 mask, u8 u)
+{
+	u8 hdrlen=1; // BTHome V2: id
+	if (objfmt == ADV_OBJFMT_BTHOME_V1)   hdrlen=2; // type|size, id
+	if (objfmt == ADV_OBJFMT_XIAOMI)	  hdrlen=3; // id (u16), size
+	for (; def->flag; def++)
+	{
+		if ((sensor_data.flags&mask&def->flag)==0)   continue;
+		if (u+hdrlen+def->size > ble_adv_payload_max)   return -1;
+		// get value
+		const u8 *src=((const u8 *)&sensor_data)+def->ofs;
+		int val=src[0];
+		if ((def->type&ADV_OBJ_SIZEMASK) == 2)	val|=(src[1]<<8);
+		if (def->type&ADV_OBJ_SIGNED)
+			val=((def->type&ADV_OBJ_SIZEMASK) == 2) ? (short)val : (signed char)val;
+		if (def->div > 1)   val/=def->div;
+		// object header
+		if (objfmt == ADV_OBJFMT_BTHOME_V1)
+			ble_advSensorData[u++]=((def->type&ADV_OBJ_SIGNED) ? BTHOME_V1_DATA_INT : BTHOME_V1_DATA_UINT) | (def->size+1); // length: id + value
+		ble_advSensorData[u++]=(u8)def->id;
+		if (objfmt == ADV_OBJFMT_XIAOMI) {
+			ble_advSensorData[u++]=(u8)(def->id>>8);
+			ble_advSensorData[u++]=def->size;
+		}
+		// object value (little endian)
+		for (u8 n=0; n<def->size; n++, val>>=8)
+			ble_advSensorData[u++]=(u8)val;
+	}
+	return u;
+}
+
+// BTHome V1/V2 objects (ordered by object id)
+static const adv_obj_def_t adv_obj_bthome[] = {
+	{DATA_FLAG_PID,		ADV_OBJ_SRC(pid, 0),			VT_PID, 1, 1},				// 0x00
+	{DATA_FLAG_BAT,		ADV_OBJ_SRC(batterypercent, 0),	VT_BATTERY_PERCENT, 1, 1},	// 0x01
+	{DATA_FLAG_TEMP,	ADV_OBJ_SRC(temperature, ADV_OBJ_SIGNED), VT_TEMPERATURE, 2, 1},	// 0x02
+	{DATA_FLAG_VOLT,	ADV_OBJ_SRC(voltage, 0),		VT_VOLTAGE, 2, 1},			// 0x0C
+	{DATA_FLAG_MOIST,	ADV_OBJ_SRC(moisture, 0),		VT_MOISTURE, 2, 1},			// 0x14
+	{0}
+};
+
+// minimal airtime: adv flags are not needed for non-connectable adv
+static inline u8 ble_adv_data_start(void)
+{
+	return (ble_adv_minimal && !ble_adv_connectable) ? 0 : ble_advSensorDataLen;
+}
+
+// per object cadence: objects in the packet for adv event evt (every n-th event, or if updated)
+_attribute_data_retention_ u8 ble_adv_cadence_built = DATA_FLAGS_DATAVALID; // cadence mask of the last build
+_attribute_data_retention_ u32 ble_adv_cadence_event = 0; // last checked adv event
+
+static u8 ble_adv_cadence_mask(u32 evt)
+{
+	u8 mask=DATA_FLAGS_DATAVALID;
+	for (u8 u=0; u<SENSOR_OBJ_CNT && sensor_cadence_enabled; u++)
+	{
+		u8 n=sensor_cadence[u]&SENSOR_CADENCE_EVERY, flag=sensor_obj_def[u].flag;
+		if (n <= 1 || (evt % n) == 0)   continue;
+		if ((sensor_cadence[u]&SENSOR_CADENCE_ONCHANGE) && (sensor_data_updated&flag))   continue;
+		mask&=(~flag);
+	}
+	return mask;
+}
+
+// returns 1: next adv event needs other objects (rebuild without data change)
+static u8 ble_adv_cadence_check(void)
+{
+	if (!sensor_cadence_enabled || ble_adv_cadence_event == ble_adv_event_cnt)   return 0;
+	ble_adv_cadence_event=ble_adv_event_cnt;
+	return ble_adv_cadence_mask(ble_adv_event_cnt+1) != ble_adv_cadence_built;
+}
+
+// objects to send (minimal airtime: no packet id if encrypted, slow objects only if updated; cadence)
+static u8 ble_adv_object_mask(u8 encrypted)
+{
+	u8 mask=ble_adv_cadence_mask(ble_adv_event_cnt+1); // payload is swapped in at the next adv event
+	ble_adv_cadence_built=mask;
+	if (ble_adv_minimal)
+	{
+		if (encrypted)   mask&=(~DATA_FLAG_PID); // encrypted data has a counter
+		if (++ble_adv_slow_cnt < SENSORDATA_MINIMAL_SLOW_CNT)
+			mask&=(~(DATA_FLAGS_SLOW & (~sensor_data_updated)));
+		else
+			ble_adv_slow_cnt=0;
+	}
+	sensor_data_updated=0;
+	return mask;
+}
+
+// device info packet (BTHome V2): firmware versions instead of the sensor objects, low rate
+enum { ADV_DEVINFO_OFF=0, ADV_DEVINFO_PENDING, ADV_DEVINFO_ONAIR };
+_attribute_data_retention_ u8 ble_adv_devinfo = ADV_DEVINFO_OFF;
+_attribute_data_retention_ u32 ble_adv_devinfo_event = 0; // adv event of the last info packet
+_attribute_data_retention_ u32 ble_adv_devinfo_time = 0; // last info packet (sec)
+_attribute_data_retention_ u8 ble_mcu_version[6] = {0,0,0,0,0,0}; // MCU soft_ver[3], hard_ver[3] (CMD_QueryMCUVersion)
+
+void app_ble_set_mcu_version(const u8 *ver, u16 len)
+{
+	if (!ver || len < sizeof(ble_mcu_version))   return;
+	memcpy(ble_mcu_version, ver, sizeof(ble_mcu_version));
+	ble_adv_devinfo=ADV_DEVINFO_PENDING; // inventory after start
+}
+
+static u8 ble_version_text(char *txt, const u8 *ver)
+{
+	u8 n=0;
+	for (u8 i=0; i<3; i++)
+	{
+		if (i)   txt[n++]='.';
+		if (ver[i] >= 100)   txt[n++]='0'+ver[i]/100;
+		if (ver[i] >= 10)    txt[n++]='0'+(ver[i]/10)%10;
+		txt[n++]='0'+ver[i]%10;
+	}
+	return n;
+}
+
+// firmware version objects (ascending ids): MCU version text "soft/hard" (truncated to fit), module firmware version
+_attribute_optimize_size_ static int ble_build_adv_versions(u8 u, u8 max)
+{
+	if (u+4 > max)   return -1;
+	if ((ble_mcu_version[0]|ble_mcu_version[1]|ble_mcu_version[2]) && u+4+3 <= max)
+	{	// text (0x53) before the firmware version (0xF2)
+		char txt[24]; u8 n=ble_version_text(txt, ble_mcu_version);
+		txt[n++]='/'; n+=ble_version_text(txt+n, ble_mcu_version+3);
+		if (u+2+n+4 > max)   n=max-u-2-4;
+		ble_advSensorData[u++]=VT_TEXT;
+		ble_advSensorData[u++]=n;
+		memcpy(&ble_advSensorData[u], txt, n); u+=n;
+	}
+	ble_advSensorData[u++]=VT_FIRMWARE_VERSION;
+	ble_advSensorData[u++]=VERSION_PATCH;
+	ble_advSensorData[u++]=VERSION_MINOR;
+	ble_advSensorData[u++]=VERSION_MAJOR;
+	return u;
+}
+
+// device info objects: packet id (not encrypted), firmware versions
+_attribute_optimize_size_ static int ble_build_adv_devinfo(u8 u, u8 encrypted)
+{
+	u8 max=ble_adv_payload_max-(encrypted ? BTHOME_CRYPT_OVERHEAD+1 : 0);
+	if (!encrypted)
+	{
+		ble_advSensorData[u++]=VT_PID;
+		ble_advSensorData[u++]=sensor_data.pid;
+	}
+	int ret=ble_build_adv_versions(u, max);
+	if (ret < 0)   return -1;
+	ble_adv_devinfo=ADV_DEVINFO_ONAIR;
+	ble_adv_devinfo_event=ble_adv_event_cnt; ble_adv_devinfo_time=app_sec_time();
+	return ret;
+}
+
 _attribute_optimize_size_ static int ble_build_adv_bthome_v1(void)
 {   // BTHome V1 format is depreciated
 	if (ble_advSensorDataLen>0 && (sensor_data.flags&DATA_FLAG_CHANGED)==0)
@@ -286,44 +774,15 @@ _attribute_optimize_size_ static int ble_build_adv_bthome_v1(void)
 	if ((sensor_data.flags&DATA_FLAGS_DATAVALID)==0)
 		return 1; // no bthome data
 	// adv bthome v1 data
-	u8 u=ble_advSensorDataLen;
+	u8 u=ble_adv_data_start();
 	u8 len_ofs=u; ble_advSensorData[u++]=3; // len: AD type + UUID16
 	ble_advSensorData[u++]=DT_SERVICEDATA_UUID16; // =0x16: AD type "Service Data 16-bit UUID"
 	ble_advSensorData[u++]=(u8)BTHOME_ADV_UUID16_V1; // =0x181C: BTHome V1
 	ble_advSensorData[u++]=(u8)(BTHOME_ADV_UUID16_V1>>8);
 	u8 data_ofs = u;
-	if (sensor_data.flags&DATA_FLAG_PID) {
-		ble_advSensorData[u++]=BTHOME_V1_DATA_UINT | 1; // datatype + valuesize
-		ble_advSensorData[u++]=VT_PID; // 0x00 value type
-		ble_advSensorData[u++]=sensor_data.pid; // value
-	}
-	if (sensor_data.flags&DATA_FLAG_BAT) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=BTHOME_V1_DATA_UINT | 1;
-		ble_advSensorData[u++]=VT_BATTERY_PERCENT; // 0x01
-		ble_advSensorData[u++]=sensor_data.batterypercent;
-	}
-	if (sensor_data.flags&DATA_FLAG_TEMP) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=BTHOME_V1_DATA_INT | 2;
-		ble_advSensorData[u++]=VT_TEMPERATURE; // 0x02
-		ble_advSensorData[u++]=(u8)(sensor_data.temperature&0xFF);
-		ble_advSensorData[u++]=(u8)(sensor_data.temperature>>8);
-	}
-	if (sensor_data.flags&DATA_FLAG_VOLT) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=BTHOME_V1_DATA_UINT | 2;
-		ble_advSensorData[u++]=VT_VOLTAGE; // 0x0C
-		ble_advSensorData[u++]=(u8)(sensor_data.voltage&0xFF);
-		ble_advSensorData[u++]=(u8)(sensor_data.voltage>>8);
-	}
-	if (sensor_data.flags&DATA_FLAG_MOIST) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=BTHOME_V1_DATA_UINT | 2;
-		ble_advSensorData[u++]=VT_MOISTURE; // 0x14
-		ble_advSensorData[u++]=(u8)(sensor_data.moisture&0xFF);
-		ble_advSensorData[u++]=(u8)(sensor_data.moisture>>8);
-	}
+	int ret=ble_build_adv_objects(adv_obj_bthome, ADV_OBJFMT_BTHOME_V1, ble_adv_object_mask(0), u);
+	if (ret < 0)   return -1;
+	u=(u8)ret;
 	// encryption: not supported
 	u8 data_len = u - data_ofs;
 	// att data: none (only bthome v2)
@@ -337,6 +796,32 @@ _attribute_optimize_size_ static int ble_build_adv_bthome_v1(void)
 	return 1;
 }
 
+// scan response (ADV_SCANRSP_DATA): device name, BTHome V2 voltage and firmware version (name + 12 bytes)
+_attribute_optimize_size_ static void ble_build_scanrsp_data(u8 bth_infoflags)
+{
+	u8 *buf=ble_advSensorData; ble_advSensorData=ble_scanRspData; // object builder target
+	u8 u=sizeof(ble_scanRsp);
+	memcpy(ble_scanRspData, ble_scanRsp, u);
+	u8 len_ofs=u; ble_scanRspData[u++]=4; // len: AD type + UUID16 + BTHome flags
+	ble_scanRspData[u++]=DT_SERVICEDATA_UUID16;
+	ble_scanRspData[u++]=(u8)BTHOME_ADV_UUID16;
+	ble_scanRspData[u++]=(u8)(BTHOME_ADV_UUID16>>8);
+	ble_scanRspData[u++]=bth_infoflags;
+	u8 data_ofs=u;
+	int ret=ble_build_adv_objects(adv_obj_bthome, ADV_OBJFMT_BTHOME_V2, DATA_FLAG_VOLT, u);
+	ble_advSensorData=buf;
+	if (ret < 0 || ret+4 > BLE_ADV_PAYLOAD_MAX)   return;
+	u=(u8)ret;
+	ble_scanRspData[u++]=VT_FIRMWARE_VERSION;
+	ble_scanRspData[u++]=VERSION_PATCH;
+	ble_scanRspData[u++]=VERSION_MINOR;
+	ble_scanRspData[u++]=VERSION_MAJOR;
+	ble_scanRspData[len_ofs]+=u-data_ofs;
+	u8 r=irq_disable(); // copied by the link layer
+	bls_ll_setScanRspData(ble_scanRspData, u);
+	irq_restore(r);
+}
+
 _attribute_optimize_size_ static int ble_build_adv_bthome_v2(void)
 {
 	if (ble_advSensorDataLen>0 && (sensor_data.flags&DATA_FLAG_CHANGED)==0)
@@ -347,75 +832,69 @@ _attribute_optimize_size_ static int ble_build_adv_bthome_v2(void)
 		return 1; // no bthome data
 	// adv bthome data
 	const u8 *encrypt_key=app_config_get_bthome_key();
-	u8 bth_infoflags=(BTHOME_ADV_VERSION<<5); // info flags: bit0: encrypted, bit 5..7: BTHome protocol version
+	u8 bth_infoflags=(BTHOME_ADV_VERSION<<5); // info flags: bit0: encrypted, bit2: trigger based, bit 5..7: BTHome protocol version
 	if (encrypt_key)   bth_infoflags |= BTHOME_ADV_FLAG_ENCRYPTED;
+	if (ble_adv_trigger)   bth_infoflags |= BTHOME_ADV_FLAG_TRIGGERBASED;
 	sensordata_increment_packetid();
-	u8 u=ble_advSensorDataLen;
+	u8 u=ble_adv_data_start();
 	u8 len_ofs=u; ble_advSensorData[u++]=4; // len: AD type + UUID16 + BTHome flags
 	ble_advSensorData[u++]=DT_SERVICEDATA_UUID16; // =0x16: AD type "Service Data 16-bit UUID"
 	ble_advSensorData[u++]=(u8)BTHOME_ADV_UUID16; // =0xFCD2: BTHome V2
 	ble_advSensorData[u++]=(u8)(BTHOME_ADV_UUID16>>8);
 	ble_advSensorData[u++]=bth_infoflags; // BTHome info
 	u8 data_ofs = u;
-	if (sensor_data.flags&DATA_FLAG_PID) {
-		ble_advSensorData[u++]=VT_PID; // 0x00
-		ble_advSensorData[u++]=sensor_data.pid;
-	}
-	if (sensor_data.flags&DATA_FLAG_BAT) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=VT_BATTERY_PERCENT; // 0x01
-		ble_advSensorData[u++]=sensor_data.batterypercent;
-	}
-	if (sensor_data.flags&DATA_FLAG_TEMP) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=VT_TEMPERATURE; // 0x02
-		ble_advSensorData[u++]=(u8)(sensor_data.temperature&0xFF);
-		ble_advSensorData[u++]=(u8)(sensor_data.temperature>>8);
-	}
-	if (sensor_data.flags&DATA_FLAG_VOLT) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=VT_VOLTAGE; // 0x0C
-		ble_advSensorData[u++]=(u8)(sensor_data.voltage&0xFF);
-		ble_advSensorData[u++]=(u8)(sensor_data.voltage>>8);
-	}
-	if (sensor_data.flags&DATA_FLAG_MOIST) {
-		if (u >= sizeof(ble_advSensorData))   return -1;
-		ble_advSensorData[u++]=VT_MOISTURE; // 0x14
-		ble_advSensorData[u++]=(u8)(sensor_data.moisture&0xFF);
-		ble_advSensorData[u++]=(u8)(sensor_data.moisture>>8);
+	u8 devinfo=(ble_adv_devinfo == ADV_DEVINFO_PENDING);
+	int ret, obj_end=0;
+	u8 scanrsp=(ble_adv_scanrsp == ADV_SCANRSP_DATA && !encrypt_key);
+	if (devinfo)
+		ret=ble_build_adv_devinfo(u, encrypt_key!=0);
+	else
+	{
+		ble_adv_devinfo=ADV_DEVINFO_OFF; // info packet replaced
+		u8 mask=ble_adv_object_mask(encrypt_key!=0);
+		if (scanrsp)   mask&=(~DATA_FLAG_VOLT); // voltage in the scan response
+		ret=obj_end=ble_build_adv_objects(adv_obj_bthome, ADV_OBJFMT_BTHOME_V2, mask, u);
+		if (ret >= 0 && ble_adv_payload_max > BLE_ADV_PAYLOAD_MAX) // long payload (ext adv): firmware versions in every packet
+			ret=ble_build_adv_versions((u8)ret, ble_adv_payload_max-(encrypt_key ? BTHOME_CRYPT_OVERHEAD+1 : 0));
 	}
+	if (ret < 0)   return -1;
+	if (scanrsp)   ble_build_scanrsp_data(bth_infoflags);
+	u=(u8)ret;
 	u8 data_len = u - data_ofs;
-	// att data (not encrypted)
+	// att data (not encrypted, sensor objects only)
 	#if (APP_BLE_ATT)
-	app_ble_att_set_bthome_data(ble_advSensorData+data_ofs, data_len);
+	if (!devinfo)   app_ble_att_set_bthome_data(ble_advSensorData+data_ofs, obj_end-data_ofs);
 	#endif
 	// encrypt
 	if (encrypt_key) {
-		u8 m, buf[20]; bthome_nonce_t nonce; u32 tag;
-		// copy data
-		if (data_len > sizeof(buf))   return -1; // length error
-		if (u+4+4 >= sizeof(ble_advSensorData))   return -1; // advertising length error (encryption adds mic+tag)
-		memcpy(buf, &ble_advSensorData[data_ofs], data_len);
-		// build nonce (iv)
-		for (m=0; m<6; m++)   nonce.mac[m]=ble_mac_public[5-m];
-		nonce.uuid16=BTHOME_ADV_UUID16; nonce.flags=bth_infoflags; nonce.cnt32=sensor_data_sendcount;
-		// encrypt
-		aes_ccm_encrypt_and_tag( encrypt_key, // key
-           (u8 *)&nonce, sizeof(nonce), // iv
-		   NULL, 0, // opt.: add data
-		   buf, data_len, // in
-		   &ble_advSensorData[data_ofs], // data out
-		   (u8 *)&tag, 4); // tag out
-		// append counter + tag (mic)
-		ble_advSensorData[u++]=(u8)(nonce.cnt32&0xFF);
-		ble_advSensorData[u++]=(u8)(nonce.cnt32>>8);
-		ble_advSensorData[u++]=(u8)(nonce.cnt32>>16);
-		ble_advSensorData[u++]=(u8)(nonce.cnt32>>24);
-		ble_advSensorData[u++]=(u8)(tag&0xFF);
-		ble_advSensorData[u++]=(u8)(tag>>8);
-		ble_advSensorData[u++]=(u8)(tag>>16);
-		ble_advSensorData[u++]=(u8)(tag>>24);
-		data_len = u - data_ofs;
+		bthome_event_crypt_t *ec=&bthome_event_crypt[ble_adv_payload_idx]; // build buffer (not on air)
+		u8 *plain=&ble_advSensorData[data_ofs]; // long payload (ext adv, no adv prepare callback): encrypted in place
+		if (u+BTHOME_CRYPT_OVERHEAD >= ble_adv_payload_max)   return -1; // advertising length error (encryption adds mic+tag)
+		if (ble_adv_payload_max == BLE_ADV_PAYLOAD_MAX)
+		{	// copy data (encryption on every adv event)
+			if (data_len > sizeof(ec->data))   return -1; // length error
+			memcpy(ec->data, plain, data_len); plain=ec->data;
+		}
+		// encrypt with next counter value (AES engine is shared with the adv prepare callback)
+		if (sensor_data_sendcount+1 >= sensor_data_sendcount_end)   return -1; // counter not reserved
+		u8 r=irq_disable();
+		ble_adv_build_cnt=++sensor_data_sendcount;
+		#if (BTHOME_ENCRYPT_PER_EVENT)
+		bthome_keystream.key=0; // measure the full path (worst case in the adv prepare callback)
+		#endif
+		u32 t=clock_time();
+		data_len=ble_bthome_encrypt(encrypt_key, bth_infoflags, sensor_data_sendcount, plain, data_len, &ble_advSensorData[data_ofs]);
+		t=clock_time()-t;
+		irq_restore(r);
+		u+=BTHOME_CRYPT_OVERHEAD;
+		// encryption on every adv event (if within the time budget)
+		#if (BTHOME_ENCRYPT_PER_EVENT)
+		ec->infoflags=bth_infoflags; ec->ofs=data_ofs; ec->len=data_len-BTHOME_CRYPT_OVERHEAD;
+		ec->advlen=u; ec->ticks=t;
+		if (plain == ec->data && t <= BTHOME_ENCRYPT_EVENT_BUDGET_US*CLOCK_16M_SYS_TIMER_CLK_1US)   ec->key=encrypt_key;
+		#else
+		(void)t;
+		#endif
 	}
 	// add data length
 	ble_advSensorData[len_ofs]+=data_len;
@@ -431,22 +910,68 @@ _attribute_optimize_size_ static int ble_build_adv_bthome_v2(void)
 #ifndef XIAOMI_DEVICE_ID
 #define XIAOMI_DEVICE_ID 0x0098 // MiFlora HHCCJCY01
 #endif
+#ifndef XIAOMI_ENCRYPT_CONN_BATTERY
+#define XIAOMI_ENCRYPT_CONN_BATTERY 0
+#endif
 
 #define XIAOMI_VALTYPE_TEMP  0x1004 // len=2 0.1C
 #define XIAOMI_VALTYPE_MOIST 0x1008 // len=1 1%
 #define XIAOMI_VALTYPE_BAT   0x100A // len=1 1%
 
+static const adv_obj_def_t adv_obj_xiaomi[] = {
+	{DATA_FLAG_TEMP,	ADV_OBJ_SRC(temperature, ADV_OBJ_SIGNED), XIAOMI_VALTYPE_TEMP, 2, 10},	// 0.01C -> 0.1C
+	{DATA_FLAG_MOIST,	ADV_OBJ_SRC(moisture, 0),		XIAOMI_VALTYPE_MOIST, 1, 100},	// 0.01% -> 1%
+	{DATA_FLAG_BAT,		ADV_OBJ_SRC(batterypercent, 0),	XIAOMI_VALTYPE_BAT, 1, 1},
+	{0}
+};
+
 #define DATA_FLAGS_XIAOMI_DATAVALID (DATA_FLAG_BAT | DATA_FLAG_TEMP | DATA_FLAG_MOIST)
 
+//
+// MiBeacon v5 encryption (AES-CCM, bindkey = BTHome key):
+//   nonce: mac (6, little endian) devid (2) msgcnt (1) ext counter (3)
+//   add data: 0x11, tag (mic): 4 bytes
+//   frame: flags devid msgcnt | encrypted objects | ext counter (3) mic (4)
+//   msgcnt + ext counter = 32 bit counter (sensor_data_sendcount)
+//
+#define XIAOMI_CRYPT_OVERHEAD	7 // ext counter + mic
+
+typedef struct _attribute_packed_ _xiaomi_nonce_t { // for encryption
+	u8  mac[6];
+	u16 devid;
+	u8  cnt;
+	u8  extcnt[3];
+} xiaomi_nonce_t;
+
+// encrypt data and append ext counter + tag (mic), returns encrypted data length
+static u8 ble_xiaomi_encrypt(const u8 *key, u16 devid, u32 cnt, const u8 *data, u8 datalen, u8 *out)
+{
+	static const u8 xiaomi_aad=0x11;
+	xiaomi_nonce_t nonce; u8 tag[4];
+	memcpy(nonce.mac, ble_mac_public, 6);
+	nonce.devid=devid; nonce.cnt=(u8)cnt;
+	nonce.extcnt[0]=(u8)(cnt>>8);  nonce.extcnt[1]=(u8)(cnt>>16);  nonce.extcnt[2]=(u8)(cnt>>24);
+	aes_ccm_encrypt_and_tag(key, (u8 *)&nonce, sizeof(nonce), &xiaomi_aad, 1, data, datalen, out, tag, 4);
+	out+=datalen;
+	memcpy(out, nonce.extcnt, 3);
+	memcpy(out+3, tag, 4);
+	return datalen+XIAOMI_CRYPT_OVERHEAD;
+}
+
 _attribute_optimize_size_ static int ble_build_adv_xiaomi(void)
 {
 	if (ble_advSensorDataLen>0 && (sensor_data.flags&DATA_FLAG_CHANGED)==0)
 		return 0; // no change
 	// adv flags
 	ble_advSensorDataLen=0; ble_build_adv_basic();
-	sensordata_increment_packetid();
-	// adv xiaomi data (encryption not supported in current version)
-	u8 u=ble_advSensorDataLen;
+	if (!ble_adv_build_mixed)   sensordata_increment_packetid();
+	// adv xiaomi data
+	const u8 *encrypt_key=app_config_get_bthome_key();
+	u8 u=ble_adv_data_start(), mask=DATA_FLAGS_DATAVALID;
+	if (encrypt_key && u)
+	{	// no room for all objects with adv flags (dropped only by DATAFORMAT_OPT_MINIMAL): one object less (XIAOMI_ENCRYPT_CONN_BATTERY)
+		mask&=(~(XIAOMI_ENCRYPT_CONN_BATTERY ? DATA_FLAG_MOIST : DATA_FLAG_BAT));
+	}
 	u8 len_ofs=u; ble_advSensorData[u++]=3+5; // len: AD type + UUID16 + xiaomi_header
 	ble_advSensorData[u++]=DT_SERVICEDATA_UUID16; // =0x16: AD type "Service Data 16-bit UUID"
 	ble_advSensorData[u++]=(u8)XIAOMI_ADV_UUID16; // =0xFE95: Xiaomi
@@ -454,50 +979,81 @@ _attribute_optimize_size_ static int ble_build_adv_xiaomi(void)
 	// xiaomi header: flags devid msgcnt
 	u16 xiaomi_flags=0, xiaomi_devid=XIAOMI_DEVICE_ID;
 	if (sensor_data.flags & DATA_FLAGS_XIAOMI_DATAVALID)   xiaomi_flags |= XIAOMI_ADV_FLAG_HASDATA;
+	if (encrypt_key)   xiaomi_flags |= XIAOMI_ADV_FLAG_ENCRYPTED | XIAOMI_ADV_FLAG_AUTHMODE_V5 | XIAOMI_ADV_FLAG_VERSION_V5;
 	ble_advSensorData[u++]=(u8)xiaomi_flags;
 	ble_advSensorData[u++]=(u8)(xiaomi_flags>>8);
 	ble_advSensorData[u++]=(u8)xiaomi_devid;
 	ble_advSensorData[u++]=(u8)(xiaomi_devid>>8);
+	u8 cnt_ofs = u;
 	ble_advSensorData[u++]=(u8)(sensor_data.pid);
 	// xiaomi data: valtype vallen data
 	u8 data_ofs = u;
-	if (sensor_data.flags&DATA_FLAG_TEMP) {
-		if (u >= sizeof(ble_advSensorData)-5)   return -1;
-		ble_advSensorData[u++]=(u8)(XIAOMI_VALTYPE_TEMP); // valtype 0x1004
-		ble_advSensorData[u++]=(u8)(XIAOMI_VALTYPE_TEMP>>8);
-		ble_advSensorData[u++]=2; // len
-		ble_advSensorData[u++]=(u8)((sensor_data.temperature/10)&0xFF);
-		ble_advSensorData[u++]=(u8)((sensor_data.temperature/10)>>8);
-	}
-	if (sensor_data.flags&DATA_FLAG_MOIST) {
-		if (u >= sizeof(ble_advSensorData)-4)   return -1;
-		ble_advSensorData[u++]=(u8)(XIAOMI_VALTYPE_MOIST); // valtype 0x100A
-		ble_advSensorData[u++]=(u8)(XIAOMI_VALTYPE_MOIST>>8);
-		ble_advSensorData[u++]=1; // len
-		ble_advSensorData[u++]=(u8)(sensor_data.moisture/100);
-	}
-	if (sensor_data.flags&DATA_FLAG_BAT) {
-		if (u >= sizeof(ble_advSensorData)-4)   return -1;
-		ble_advSensorData[u++]=(u8)(XIAOMI_VALTYPE_BAT); // valtype 0x100A
-		ble_advSensorData[u++]=(u8)(XIAOMI_VALTYPE_BAT>>8);
-		ble_advSensorData[u++]=1; // len
-		ble_advSensorData[u++]=(u8)(sensor_data.batterypercent);
-	}
+	int ret=ble_build_adv_objects(adv_obj_xiaomi, ADV_OBJFMT_XIAOMI, mask, u);
+	if (ret < 0)   return -1;
+	u=(u8)ret;
 	u8 data_len = u - data_ofs;
-	// att data
+	// att data (not encrypted)
 	#if (APP_BLE_ATT)
 	app_ble_att_set_xiaomi_data(ble_advSensorData+data_ofs, data_len);
 	#endif
+	// encrypt
+	if (encrypt_key)
+	{
+		if (u+XIAOMI_CRYPT_OVERHEAD > ble_adv_payload_max)   return -1; // advertising length error
+		if (sensor_data_sendcount+1 >= sensor_data_sendcount_end && !ble_adv_build_mixed)   return -1; // counter not reserved
+		u8 r=irq_disable(); // AES engine + counter are shared with the adv prepare callback
+		u32 cnt=ble_adv_build_cnt; // mixed: counter of the BTHome frame (other nonce format)
+		if (!ble_adv_build_mixed)   cnt=++sensor_data_sendcount;
+		ble_advSensorData[cnt_ofs]=(u8)cnt;
+		data_len=ble_xiaomi_encrypt(encrypt_key, xiaomi_devid, cnt,
+			&ble_advSensorData[data_ofs], data_len, &ble_advSensorData[data_ofs]);
+		irq_restore(r);
+		u+=XIAOMI_CRYPT_OVERHEAD;
+	}
 	ble_advSensorData[len_ofs]+=data_len; // add adata length
 	ble_advSensorDataLen=u;
 	sensor_data.flags&=(~DATA_FLAG_CHANGED); // reset changed flag
 	return 1;
 }
 
+// mixed format: BTHome V2 (encryption state) into the build buffer, then Xiaomi into the alternate buffer
+// (one packet id and counter value per data change)
+_attribute_optimize_size_ static int ble_build_adv_mixed(void)
+{
+	if (ble_advSensorDataLen>0 && (sensor_data.flags&DATA_FLAG_CHANGED)==0)
+		return 0; // no change
+	ble_adv_payload_alt_len[ble_adv_payload_idx]=0;
+	int ret=ble_build_adv_bthome_v2();
+	if (ret <= 0)   return ret;
+	u8 *buf=ble_advSensorData, len=ble_advSensorDataLen;
+	ble_advSensorData=ble_adv_payload_alt[ble_adv_payload_idx]; ble_advSensorDataLen=0;
+	sensor_data.flags|=DATA_FLAG_CHANGED; ble_adv_build_mixed=1;
+	if (ble_build_adv_xiaomi() > 0)
+		ble_adv_payload_alt_len[ble_adv_payload_idx]=ble_advSensorDataLen;
+	ble_adv_build_mixed=0;
+	ble_advSensorData=buf; ble_advSensorDataLen=len;
+	return ret;
+}
+
 static int ble_build_adv_sensordata(void)
 {
 	int ret=0; u8 datafmt=app_config_get_dataformat();
-	if (datafmt == DATAFORMAT_DEFAULT || datafmt == DATAFORMAT_BTHOME_V2)
+	u8 r=irq_disable(); // the adv prepare callback swaps the build buffer
+	u8 swap=ble_adv_payload_swap, idx=ble_adv_payload_idx;
+	ble_adv_payload_swap=0; // build buffer not ready while rebuilding
+	irq_restore(r);
+	ble_adv_minimal=(datafmt & DATAFORMAT_OPT_MINIMAL)!=0;
+	datafmt&=DATAFORMAT_MASK;
+	ble_adv_mix_ratio=0;
+	if (datafmt == DATAFORMAT_MIXED && ble_adv_payload_max > BLE_ADV_PAYLOAD_MAX)
+		datafmt=DATAFORMAT_BTHOME_V2; // long payload (ext adv): no adv prepare callback to alternate
+	if (datafmt == DATAFORMAT_MIXED)
+	{
+		ble_adv_mix_ratio=app_config_get_advoption(ADVOPT_MIXRATIO);
+		if (ble_adv_mix_ratio == 0)   ble_adv_mix_ratio=1;
+		ret=ble_build_adv_mixed();
+	}
+	else if (datafmt == DATAFORMAT_DEFAULT || datafmt == DATAFORMAT_BTHOME_V2)
 		ret=ble_build_adv_bthome_v2();
 	else if (datafmt == DATAFORMAT_BTHOME_V1)
 		ret=ble_build_adv_bthome_v1();
@@ -505,6 +1061,10 @@ static int ble_build_adv_sensordata(void)
 		ret=ble_build_adv_xiaomi();
 	else
 		ret=ble_build_adv_basic();
+	if (ret == 0 && swap && idx == ble_adv_payload_idx)
+		ble_adv_payload_swap=1; // unchanged: still pending
+	if (datafmt != DATAFORMAT_MIXED)
+		ble_adv_payload_alt_len[ble_adv_payload_idx]=0;
 	return ret;
 }
 
@@ -517,32 +1077,211 @@ enum { DEV_CONN_STATE_NONE=0,
 _attribute_data_retention_ u8 ble_device_connection_state = DEV_CONN_STATE_NONE;
 _attribute_data_retention_ u8 ble_security_level = No_Security;
 _attribute_data_retention_ u32 ble_connection_timeout = 0; // sec
-_attribute_data_retention_ u8 ble_rf_power_level = RF_POWER_P3p01dBm;
+_attribute_data_retention_ u8 ble_rf_power_level = RF_POWER_P3p01dBm; // current (restored after sleep)
+_attribute_data_retention_ u8 ble_rf_conn_power_level = RF_POWER_P3p01dBm; // connection: config level
+_attribute_data_retention_ u8 ble_rf_adv_power_level = RF_POWER_P3p01dBm; // adv: calibrated level
 
 static bool inline isIrkValid(const u8* pIrk)
 {	// check, if IRK is valid (16 Bytes)
 	return isAppMemValid(pIrk, 16); // check if not 00 or FF
 }
 
-_attribute_optimize_size_ void app_ble_set_powerlevel(signed char level_dbm)
+static const struct {signed char level; u8 rf;} ble_level2rf[] = {
+	{9, RF_POWER_P8p97dBm},	{8, RF_POWER_P8p13dBm}, {7, RF_POWER_P7p02dBm},
+	{6, RF_POWER_P6p14dBm}, {5, RF_POWER_P5p13dBm},	{4, RF_POWER_P3p94dBm},
+	{3, RF_POWER_P3p01dBm},	{2, RF_POWER_P1p99dBm}, {1, RF_POWER_P0p90dBm},
+	{0, RF_POWER_P0p04dBm}, {-1, RF_POWER_N0p97dBm}, {-3, RF_POWER_N3p03dBm},
+	{-5, RF_POWER_N5p03dBm}, {-10, RF_POWER_N9p89dBm}, {-127, RF_POWER_N19p27dBm} // lowest
+};
+
+static u8 ble_rf_level_index(signed char level_dbm)
 {
-	static const struct {signed char level; u8 rf;} level2rf[] = {
-		{9, RF_POWER_P8p97dBm},	{8, RF_POWER_P8p13dBm}, {7, RF_POWER_P7p02dBm},
-		{6, RF_POWER_P6p14dBm}, {5, RF_POWER_P5p13dBm},	{4, RF_POWER_P3p94dBm},
-		{3, RF_POWER_P3p01dBm},	{2, RF_POWER_P1p99dBm}, {1, RF_POWER_P0p90dBm},
-		{0, RF_POWER_P0p04dBm}, {-1, RF_POWER_N0p97dBm}, {-3, RF_POWER_N3p03dBm},
-		{-5, RF_POWER_N5p03dBm}, {-10, RF_POWER_N9p89dBm}, {-127, RF_POWER_N19p27dBm} // lowest
-	};
 	u8 u, rf=RF_POWER_P10p01dBm; // highest
-	for (u=0; u<sizeof(level2rf)/sizeof(level2rf[0]); u++) {
-		if (level2rf[u].level<level_dbm)   break;
-		rf=level2rf[u].rf;
+	for (u=0; u<sizeof(ble_level2rf)/sizeof(ble_level2rf[0]); u++) {
+		if (ble_level2rf[u].level<level_dbm)   break;
+		rf=ble_level2rf[u].rf;
 	}
-	ble_rf_power_level=rf;
+	return rf;
+}
+
+static void ble_rf_power_select(void)
+{	// connection: config level, adv: calibrated level
+	ble_rf_power_level=(ble_device_connection_state & DEV_CONN_STATE_CONNECTED) ? ble_rf_conn_power_level : ble_rf_adv_power_level;
 	rf_set_power_level_index(ble_rf_power_level); // RF driver
 	DEBUGFMT(APP_BLE_LOG_EN, "[BLE] RF PowerLevel index %02X", ble_rf_power_level);
 }
 
+// adv power level (dbm): config level, limited by the calibrated level
+static signed char ble_adv_level_dbm(signed char level_dbm)
+{
+	#if (BLE_TXPOWER_CALIBRATION)
+	signed char level_cal=app_config_get_txcal_level();
+	if (level_cal < level_dbm)   level_dbm=level_cal; // calibrated (config level is the max.)
+	#endif
+	return level_dbm;
+}
+
+_attribute_optimize_size_ void app_ble_set_powerlevel(signed char level_dbm)
+{
+	ble_rf_conn_power_level=ble_rf_level_index(level_dbm);
+	ble_rf_adv_power_level=ble_rf_level_index(ble_adv_level_dbm(level_dbm));
+	ble_rf_power_select();
+}
+
+//
+// TX power calibration (secured connection with the bonded gateway):
+//   step TX power down while probe notifications are acked by the gateway without retransmissions
+//   (the gateway receives our packets: depends on our TX level, not on the RSSI we measure),
+//   the lowest reliable level + offset is stored as adv power level (re-calibrated on every connection),
+//   connections always use the config level
+//
+#if (BLE_TXPOWER_CALIBRATION)
+enum { TXCAL_OFF=0, TXCAL_RUN, TXCAL_DONE };
+_attribute_data_retention_ u8 ble_txcal_state = TXCAL_OFF;
+_attribute_data_retention_ signed char ble_txcal_level = 0; // current level (dbm)
+_attribute_data_retention_ signed char ble_txcal_good = 0; // lowest reliable level (dbm)
+_attribute_data_retention_ u32 ble_txcal_time = 0; // last step (tick)
+_attribute_data_retention_ u8 ble_txcal_steps = 0; // completed steps (good level measured)
+_attribute_data_retention_ u32 ble_txcal_probe = 0; // probes sent (tick), 0: none pending
+_attribute_data_retention_ u8 ble_txcal_sent = 0; // probes sent at current level
+
+static void ble_txcal_start(void)
+{
+	ble_txcal_level=ble_txcal_good=app_config_get_power_level();
+	ble_rf_power_level=ble_rf_level_index(ble_txcal_level); // start at max. level
+	rf_set_power_level_index(ble_rf_power_level);
+	ble_txcal_time=clock_time(); ble_txcal_state=TXCAL_RUN; ble_txcal_steps=0; ble_txcal_probe=0;
+	DEBUGFMT(APP_BLE_LOG_EN, "[BLE] TX calibration start %d dbm", ble_txcal_level);
+}
+
+static void ble_txcal_finish(u8 store)
+{
+	if (ble_txcal_state != TXCAL_RUN)   return;
+	ble_txcal_state=TXCAL_DONE; ble_txcal_probe=0;
+	if (store && ble_txcal_steps)
+	{	// at least one level verified
+		signed char level=ble_txcal_good+BLE_TXCAL_OFFSET_DB;
+		if (level > app_config_get_power_level())   level=app_config_get_power_level();
+		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] TX calibration done: reliable %d dbm, adv %d dbm", ble_txcal_good, level);
+		app_config_set_txcal_level(level);
+	}
+	app_ble_set_powerlevel(app_config_get_power_level());
+}
+
+static void ble_txcal_loop(void)
+{
+	if (ble_txcal_state != TXCAL_RUN)   return;
+	if (ble_ota_is_working != BLE_OTA_NONE)
+	{	// no calibration during OTA
+		ble_txcal_finish(0);
+		return;
+	}
+	if (!ble_txcal_probe)
+	{	// send probes at current level (after step time, tx fifo empty)
+		if (!clock_time_exceed(ble_txcal_time, BLE_TXCAL_STEP_MS*1000) || blc_ll_getTxFifoNumber())   return;
+		ble_txcal_sent=0;
+		#if (APP_BLE_ATT)
+		u8 u;
+		for (u=0; u<BLE_TXCAL_PROBES; u++)
+			ble_txcal_sent+=app_ble_att_push_bthome_data();
+		#endif
+		if (!ble_txcal_sent)
+		{	// BTHome data not subscribed: no probes
+			DEBUGSTR(APP_BLE_LOG_EN, "[BLE] TX calibration: no probes (not subscribed)");
+			ble_txcal_finish(0);
+			return;
+		}
+		ble_txcal_probe=clock_time()|1;
+		return;
+	}
+	// probes acked (tx fifo empty) within the connection events needed without retransmissions
+	u32 t_max=(u32)(ble_txcal_sent+BLE_TXCAL_LOSS_EVENTS+1)*bls_ll_getConnectionInterval()*1250; // us (+1: loop delay)
+	u8 txfifo=blc_ll_getTxFifoNumber();
+	if (txfifo && !clock_time_exceed(ble_txcal_probe, t_max))   return; // wait for acks
+	u32 t=(clock_time()-ble_txcal_probe)/CLOCK_16M_SYS_TIMER_CLK_1US;
+	ble_txcal_probe=0; ble_txcal_time=clock_time();
+	DEBUGFMT(APP_BLE_LOG_EN, "[BLE] TX calibration %d dbm: %u probes acked after %u us (max. %u), tx fifo %u",
+		ble_txcal_level, ble_txcal_sent, t, t_max, txfifo);
+	if (txfifo || t > t_max)
+	{	// retransmissions at this level: last good level
+		ble_txcal_finish(1);
+		return;
+	}
+	ble_txcal_good=ble_txcal_level; ble_txcal_steps++;
+	// next lower level (not the lowest table entry)
+	u8 u;
+	for (u=0; u<sizeof(ble_level2rf)/sizeof(ble_level2rf[0])-1; u++)
+		if (ble_level2rf[u].level < ble_txcal_level)   break;
+	if (u >= sizeof(ble_level2rf)/sizeof(ble_level2rf[0])-1)
+	{	// lowest level reached
+		ble_txcal_finish(1);
+		return;
+	}
+	ble_txcal_level=ble_level2rf[u].level;
+	ble_rf_power_level=ble_level2rf[u].rf;
+	rf_set_power_level_index(ble_rf_power_level);
+}
+#endif
+
+//
+// Push mode: directed adv (high duty) to the bonded gateway on data change or heartbeat,
+//   BTHome data notification after encryption, then disconnect (silent in between)
+//
+static void ble_adv_push_connstate(void)
+{
+	u8 state=ble_device_connection_state;
+	if (ble_adv_push == ADV_PUSH_ADV && (state & DEV_CONN_STATE_CONNECTED))
+	{
+		ble_adv_push=ADV_PUSH_CONN; ble_adv_push_tick=clock_time()|1;
+	}
+	if (ble_adv_push == ADV_PUSH_CONN && (state & DEV_CONN_STATE_ENCRYPTED))
+	{	// bonded gateway
+		#if (APP_BLE_ATT)
+		u8 sent=app_ble_att_push_bthome_data();
+		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] ADV push notify %s", sent ? "sent" : "not subscribed");
+		#endif
+		ble_adv_push=ADV_PUSH_SENT; ble_adv_push_tick=clock_time()|1;
+	}
+	if (ble_adv_push >= ADV_PUSH_CONN && ble_adv_push < ADV_PUSH_DONE && state == DEV_CONN_STATE_NONE)
+		ble_adv_push=ADV_PUSH_DONE; // adv off (app_ble_loop)
+}
+
+static void ble_adv_push_update(u8 changed)
+{
+	if (changed)   ble_adv_push_pending=1;
+	if (ble_adv_push == ADV_PUSH_ADV && clock_time_exceed(ble_adv_push_tick, SENSORDATA_PUSH_ADV_MS*1000))
+	{	// gateway not reachable: retry on next data change or heartbeat
+		DEBUGSTR(APP_BLE_LOG_EN, "[BLE] ADV push timeout");
+		ble_adv_push=ADV_PUSH_DONE;
+	}
+	if ((ble_adv_push == ADV_PUSH_CONN && clock_time_exceed(ble_adv_push_tick, SENSORDATA_PUSH_CONN_MS*1000)) ||
+		(ble_adv_push == ADV_PUSH_SENT && (blc_ll_getTxFifoNumber() == 0 ||
+		 clock_time_exceed(ble_adv_push_tick, SENSORDATA_PUSH_CONN_MS*1000))))
+	{	// notification sent (or not encrypted in time): disconnect
+		bls_ll_terminateConnection(HCI_ERR_REMOTE_USER_TERM_CONN);
+		ble_adv_push=ADV_PUSH_TERM;
+	}
+	if (ble_adv_push == ADV_PUSH_DONE)
+	{
+		bls_ll_setAdvEnable(BLC_ADV_DISABLE);
+		ble_adv_push=ADV_PUSH_IDLE; ble_adv_push_wakeup=0;
+	}
+	if (ble_adv_push == ADV_PUSH_IDLE &&
+		(ble_adv_push_pending || app_sec_time_exceeds(ble_adv_push_time, SENSORDATA_PUSH_HEARTBEAT_SEC)))
+	{
+		DEBUGSTR(APP_BLE_LOG_EN, "[BLE] ADV push start");
+		bls_ll_setAdvEnable(BLC_ADV_ENABLE);
+		ble_adv_push=ADV_PUSH_ADV; ble_adv_push_pending=0;
+		ble_adv_push_tick=clock_time()|1; ble_adv_push_time=app_sec_time();
+	}
+	if (ble_adv_push == ADV_PUSH_IDLE &&
+		(!ble_adv_push_wakeup || clock_time_exceed(ble_adv_push_wakeup, SENSORDATA_TRIGGER_WAKEUP_SEC*1000000)))
+	{	// no adv events: wake up for heartbeat and app timers
+		ble_adv_push_wakeup=clock_time()|1;
+		bls_pm_setAppWakeupLowPower(ble_adv_push_wakeup+SENSORDATA_TRIGGER_WAKEUP_SEC*CLOCK_16M_SYS_TIMER_CLK_1S, 1);
+	}
+}
+
 _attribute_optimize_size_ void ble_set_conn_state(u8 state)
 {
 	u8 state_old = ble_device_connection_state;
@@ -552,19 +1291,190 @@ _attribute_optimize_size_ void ble_set_conn_state(u8 state)
 	{ 	// add conn state info
 		ble_device_connection_state |= state;
 	}
+	if ((ble_device_connection_state ^ state_old) & DEV_CONN_STATE_CONNECTED)
+		ble_rf_power_select(); // connection: config level, adv: calibrated level
 	if (ble_device_connection_state != state_old)
 	{
 		u8 n[2]; n[0]=ble_device_connection_state; n[1]=state_old;
 	    app_notify(APP_NOTIFY_CONNSTATE, n, 2);
 	}
+	if (ble_adv_push)
+		ble_adv_push_connstate();
+	#if (BLE_TXPOWER_CALIBRATION)
+	if ((ble_device_connection_state & DEV_CONN_STATE_ENCRYPTED) && !(state_old & DEV_CONN_STATE_ENCRYPTED) &&
+		blc_smp_param_getCurrentBondingDeviceNumber() > 0 && !ble_adv_push)
+		ble_txcal_start(); // bonded gateway (not in push mode: short connections)
+	#endif
+}
+
+//
+// Adv phase spreading (many devices with the same interval and start time, e.g. battery swap):
+//   MAC-seeded phase offset once at adv start (first adv event), jitter by the link layer
+//   adv interval range (min..min+SENSORDATA_ADV_JITTER_PCT)
+//
+_attribute_data_retention_ u32 ble_adv_rand = 1; // xorshift32 state (MAC-seeded)
+_attribute_data_retention_ u16 ble_adv_base = 0; // base interval (0: no spreading)
+_attribute_data_retention_ u16 ble_adv_phase = 0; // interval of the first adv event (phase offset, 0: none)
+_attribute_data_retention_ u8 ble_adv_phase_on = 0; // phase interval set: back to the interval range at the next adv event
+
+#if (SENSORDATA_ADV_SPREAD || SENSORDATA_ADV_ADAPTIVE)
+// max. adv interval of the link layer interval range
+_attribute_ram_code_ static u16 ble_adv_interval_max(u16 interval)
+{
+	if (ble_adv_base)   return interval+(u16)(((u32)interval*SENSORDATA_ADV_JITTER_PCT)/100);
+	return interval+(interval/10);
+}
+#endif
+
+#if (SENSORDATA_ADV_SPREAD)
+_attribute_ram_code_ static u32 ble_adv_random(void)
+{
+	u32 x=ble_adv_rand;
+	x^=x<<13; x^=x>>17; x^=x<<5;
+	ble_adv_rand=x;
+	return x;
+}
+
+static void ble_adv_spread_init(u16 interval)
+{
+	u32 h=2166136261u; // FNV-1a (MAC)
+	for (u8 u=0; u<6; u++)   h=(h^ble_mac_public[u])*16777619u;
+	ble_adv_rand=(h) ? h : 1;
+	ble_adv_base=interval; ble_adv_phase=(u16)(ble_adv_random()%interval);
+	if (ble_adv_phase < ADV_INTERVAL_20MS)   ble_adv_phase=ADV_INTERVAL_20MS;
+	bls_ll_setAdvInterval(interval, ble_adv_interval_max(interval));
+	DEBUGFMT(APP_BLE_LOG_EN, "[BLE] ADV phase %u ms", (ble_adv_phase*5)/8);
+}
+
+// phase offset (adv prepare callback): only the first adv event after adv start
+_attribute_ram_code_ static void ble_adv_spread_event(void)
+{
+	if (ble_adv_phase)
+	{
+		bls_ll_setAdvInterval(ble_adv_phase, ble_adv_phase);
+		ble_adv_phase=0; ble_adv_phase_on=1;
+	}
+	else if (ble_adv_phase_on)
+	{	// current base interval (adaptive interval steps)
+		bls_ll_setAdvInterval(ble_adv_base, ble_adv_interval_max(ble_adv_base));
+		ble_adv_phase_on=0;
+	}
+}
+#endif
+
+//
+// Adaptive adv interval (ADV mode noconn):
+//   fast interval for some events after a data change, then doubled step by step
+//   up to SENSORDATA_ADV_INTERVAL (adv parameters are only changed at step boundaries)
+//
+_attribute_data_retention_ u16 ble_adv_interval = 0; // current interval (0: not adaptive)
+_attribute_data_retention_ u8 ble_adv_interval_events = 0; // adv events with current interval
+
+#if (SENSORDATA_ADV_ADAPTIVE)
+static void ble_adv_interval_update(u8 changed)
+{
+	u16 interval=ble_adv_interval;
+	if (changed)
+	{
+		interval=SENSORDATA_ADV_INTERVAL_FAST; ble_adv_interval_events=0;
+	}
+	else if (interval < SENSORDATA_ADV_INTERVAL)
+	{
+		u8 events=(interval == SENSORDATA_ADV_INTERVAL_FAST) ? SENSORDATA_ADV_FAST_EVENTS : SENSORDATA_ADV_BACKOFF_EVENTS;
+		if (ble_adv_interval_events >= events)   interval*=2;
+		if (interval > SENSORDATA_ADV_INTERVAL)   interval=SENSORDATA_ADV_INTERVAL;
+	}
+	if (interval == ble_adv_interval)   return; // no step boundary
+	ble_adv_interval=interval; ble_adv_interval_events=0;
+	if (ble_adv_base)   ble_adv_base=interval; // spreading: also after a phase event
+	bls_ll_setAdvInterval(interval, ble_adv_interval_max(interval));
+	DEBUGFMT(APP_BLE_LOG_EN, "[BLE] ADV interval %u ms", (interval*5)/8);
+}
+#endif
+
+static void ble_adv_trigger_update(u8 changed)
+{
+	if (changed)
+	{	// start burst (adv enabled by app_ble_loop)
+		DEBUGSTR(APP_BLE_LOG_EN, "[BLE] ADV trigger burst");
+		ble_adv_trigger=ADV_TRIGGER_BURST; ble_adv_interval_events=0;
+		ble_adv_trigger_time=app_sec_time();
+		#if (SENSORDATA_ADV_SPREAD)
+		if (ble_adv_base)   ble_adv_phase=ADV_INTERVAL_20MS+(u16)(ble_adv_random()%ble_adv_base); // burst phase
+		#endif
+		return;
+	}
+	if (ble_adv_trigger == ADV_TRIGGER_BURST && ble_adv_interval_events >= SENSORDATA_TRIGGER_EVENTS)
+	{	// burst done: adv off
+		bls_ll_setAdvEnable(BLC_ADV_DISABLE);
+		ble_adv_trigger=ADV_TRIGGER_IDLE; ble_adv_trigger_wakeup=0;
+	}
+	if (ble_adv_trigger == ADV_TRIGGER_IDLE &&
+		(!ble_adv_trigger_wakeup || clock_time_exceed(ble_adv_trigger_wakeup, SENSORDATA_TRIGGER_WAKEUP_SEC*1000000)))
+	{	// no adv events: wake up for heartbeat and app timers
+		ble_adv_trigger_wakeup=clock_time()|1;
+		bls_pm_setAppWakeupLowPower(ble_adv_trigger_wakeup+SENSORDATA_TRIGGER_WAKEUP_SEC*CLOCK_16M_SYS_TIMER_CLK_1S, 1);
+	}
+}
+
+//
+// Adv channel rotation (sensor data): one or two channels per adv event
+//
+static const u8 ble_adv_channel_maps[ADV_CHANNELS_LAST][3] = {
+	{BLT_ENABLE_ADV_ALL, BLT_ENABLE_ADV_ALL, BLT_ENABLE_ADV_ALL},
+	{BLT_ENABLE_ADV_37, BLT_ENABLE_ADV_38, BLT_ENABLE_ADV_39},
+	{BLT_ENABLE_ADV_37|BLT_ENABLE_ADV_38, BLT_ENABLE_ADV_38|BLT_ENABLE_ADV_39, BLT_ENABLE_ADV_39|BLT_ENABLE_ADV_37}
+};
+_attribute_data_retention_ u8 ble_adv_channels = ADV_CHANNELS_ALL;
+_attribute_data_retention_ u8 ble_adv_channel_idx = 0;
+
+_attribute_ram_code_ static void ble_adv_packet_set(rf_packet_adv_t *p, const u8 *src, u8 len)
+{
+	for (u8 u=0; u<len; u++)   p->data[u]=src[u];
+	p->rf_len=6+len; p->dma_len=p->rf_len+2;
 }
 
 // callback adv prepare (set by bls_set_advertise_prepare)
 _attribute_ram_code_ int ble_advertise_prepare_handler(rf_packet_adv_t * p)
 {
-	(void) p;
-	if (ble_adv_mode == BLE_ADV_MODE_SensorData)
+	if (ble_adv_mode == BLE_ADV_MODE_SensorData && !ble_adv_push) // push: directed adv without data
+	{
+		if (ble_adv_interval_events < 255)   ble_adv_interval_events++;
+		ble_adv_event_cnt++;
+		#if (SENSORDATA_ADV_SPREAD)
+		ble_adv_spread_event();
+		#endif
+		if (ble_adv_payload_swap)
+		{	// new payload
+			ble_adv_packet_set(p, ble_adv_payload[ble_adv_payload_idx], ble_adv_payload_len[ble_adv_payload_idx]);
+			ble_adv_payload_idx^=1; ble_advSensorData=ble_adv_payload[ble_adv_payload_idx];
+			ble_adv_payload_swap=0; ble_adv_payload_alt_on=0; ble_adv_mix_cnt=0;
+		}
+		else if (ble_adv_mix_ratio)
+		{	// mixed format: alternate payload every (ratio+1)-th event
+			u8 set=ble_adv_payload_idx^1; // on air
+			u8 alt=(ble_adv_payload_alt_len[set] && ++ble_adv_mix_cnt > ble_adv_mix_ratio);
+			if (alt)   ble_adv_mix_cnt=0;
+			if (alt != ble_adv_payload_alt_on)
+			{
+				if (alt)   ble_adv_packet_set(p, ble_adv_payload_alt[set], ble_adv_payload_alt_len[set]);
+				else       ble_adv_packet_set(p, ble_adv_payload[set], ble_adv_payload_len[set]);
+				ble_adv_payload_alt_on=alt;
+			}
+		}
+		if (ble_adv_channels != ADV_CHANNELS_ALL)
+		{	// next channel set
+			if (++ble_adv_channel_idx >= 3)   ble_adv_channel_idx=0;
+			bls_ll_setAdvChannelMap(ble_adv_channel_maps[ble_adv_channels][ble_adv_channel_idx]);
+		}
+		if (sensor_data_sendcount+1 >= sensor_data_sendcount_end)
+			return 1; // counter not reserved: send last packet again
 		sensor_data_sendcount++;
+		#if (BTHOME_ENCRYPT_PER_EVENT)
+		if (bthome_event_crypt[ble_adv_payload_idx^1].key && !ble_adv_payload_alt_on)
+			ble_bthome_encrypt_event(p); // new counter: encrypt again
+		#endif
+	}
 	return 1; // = 1 ready to send ADV packet, = 0 not send ADV
 }
 
@@ -587,6 +1497,17 @@ void ble_task_connect (u8 e, u8 *p, int n)
 	bls_l2cap_requestConnParamUpdate(CONN_INTERVAL_10MS, CONN_INTERVAL_15MS, 99, CONN_TIMEOUT_4S); // 1 sec (must: max_interval>min_interval)
 	ble_connection_timeout = app_sec_time(); if (ble_connection_timeout<1)   ble_connection_timeout=1;
 	ble_set_conn_state(DEV_CONN_STATE_CONNECTED);
+	DEBUGFMT(APP_BLE_LOG_EN, "[BLE] Stat: adv events %u, scan rsp %u", ble_adv_event_cnt, ble_scanrsp_cnt);
+	#if (APP_BLE_ATT)
+	app_ble_att_set_statistics(ble_adv_event_cnt, ble_scanrsp_cnt);
+	#endif
+}
+
+// callback function of LinkLayer Event BLT_EV_FLAG_SCAN_RSP
+_attribute_ram_code_ void ble_task_scan_rsp(u8 e, u8 *p, int n)
+{
+	(void)e;(void)p;(void)n;
+	ble_scanrsp_cnt++;
 }
 
 // callback function of LinkLayer Event BLT_EV_FLAG_TERMINATE
@@ -611,6 +1532,9 @@ void ble_task_terminate(u8 e, u8 *p, int n) //*p is terminate reason
 		app_notify(APP_NOTIFY_REBOOT, 0, 0);
 	ble_connection_timeout = 0;
 	ble_ota_is_working = BLE_OTA_NONE;
+	#if (BLE_TXPOWER_CALIBRATION)
+	ble_txcal_finish(1); // calibration not finished: last good level (link lost at current level)
+	#endif
 	ble_set_conn_state(DEV_CONN_STATE_NONE);
 }
 
@@ -741,11 +1665,130 @@ _attribute_optimize_size_ void app_ota_end_result(int result)
 _attribute_ble_data_retention_	_attribute_aligned_(4)	flash_prot_op_callback_t flash_prot_op_cb = NULL;
 #endif
 
+//
+// Extended adv on LE Coded PHY (DEVMODE_MEASURE_CODED)
+//   the SDK ext adv module replaces the legacy adv module (selected at power on),
+//   connection mode uses legacy PDUs via the ext adv API
+//   note: no adv prepare callback (per event encryption, channel rotation, adaptive interval, mixed format)
+//   note: the module is selected at boot: a device mode change to/from coded reboots on disconnect
+//   long payload: all objects of the mask and the firmware versions in every packet (no device info packet)
+//
+#if (BLE_EXT_ADV_CODED_ENABLE)
+#define	BLE_EXT_ADV_SETS		1
+#define	BLE_EXT_ADV_DATA_LEN	229 // BTHome payload (ext adv data, one AUX_ADV_IND)
+_attribute_data_retention_ u8 ble_ext_adv = 0; // ext adv module active
+_attribute_data_retention_ u8 ble_ext_adv_set_param[ADV_SET_PARAM_LENGTH * BLE_EXT_ADV_SETS];
+_attribute_data_retention_ u8 ble_ext_adv_primary_pkt[MAX_LENGTH_PRIMARY_ADV_PKT * BLE_EXT_ADV_SETS];
+_attribute_data_retention_ u8 ble_ext_adv_secondary_pkt[MAX_LENGTH_SECOND_ADV_PKT * BLE_EXT_ADV_SETS];
+_attribute_data_retention_ u8 ble_ext_adv_data[BLE_EXT_ADV_DATA_LEN * BLE_EXT_ADV_SETS];
+_attribute_data_retention_ u8 ble_ext_scanrsp_data[sizeof(ble_scanRsp) * BLE_EXT_ADV_SETS];
+_attribute_data_retention_ u8 ble_ext_adv_payload[BLE_EXT_ADV_DATA_LEN]; // build buffer
+
+static void ble_ext_adv_init(void)
+{
+	blc_ll_initExtendedAdvertising_module(ble_ext_adv_set_param, ble_ext_adv_primary_pkt, BLE_EXT_ADV_SETS);
+	blc_ll_initExtSecondaryAdvPacketBuffer(ble_ext_adv_secondary_pkt, MAX_LENGTH_SECOND_ADV_PKT);
+	blc_ll_initExtAdvDataBuffer(ble_ext_adv_data, BLE_EXT_ADV_DATA_LEN);
+	blc_ll_initExtScanRspDataBuffer(ble_ext_scanrsp_data, sizeof(ble_scanRsp));
+	blc_ll_init2MPhyCodedPhy_feature(); // LE Coded PHY
+	ble_advSensorData=ble_ext_adv_payload; ble_adv_payload_max=BLE_EXT_ADV_DATA_LEN; // long payload
+	ble_ext_adv=1;
+}
+
+// ext adv TX power parameter: same level as legacy adv (0..10 dbm, the RF driver level is set after setup)
+static tx_pow_t ble_ext_adv_tx_power(void)
+{
+	signed char level_dbm=ble_adv_level_dbm(app_config_get_power_level());
+	if (level_dbm < 0)    level_dbm=0;
+	if (level_dbm > 10)   level_dbm=10;
+	return (tx_pow_t)(TX_POWER_0dBm+level_dbm);
+}
+
+static ble_sts_t ble_ext_adv_setup(u8 adv_mode)
+{
+	ble_sts_t ret=BLE_SUCCESS;
+	tx_pow_t tx_power=ble_ext_adv_tx_power();
+	blc_ll_setExtAdvEnable_1(BLC_ADV_DISABLE, 1, ADV_HANDLE0, 0, 0);
+	if (adv_mode == BLE_ADV_MODE_Conn)
+	{	// legacy connectable PDUs on 1M PHY (pairing/config)
+		DEBUGSTR(APP_BLE_LOG_EN, "[BLE] Start ADVind (ext adv)");
+		ret = blc_ll_setExtAdvParam(ADV_HANDLE0, ADV_EVT_PROP_LEGACY_CONNECTABLE_SCANNABLE_UNDIRECTED,
+				BLE_CONN_ADV_INTERVAL_MIN, BLE_CONN_ADV_INTERVAL_MAX, BLT_ENABLE_ADV_ALL,
+				ble_own_address_type, 0, NULL, ADV_FP_NONE, tx_power,
+				BLE_PHY_1M, 0, BLE_PHY_1M, ADV_SID_0, 0);
+		blc_ll_setExtAdvData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, sizeof(ble_advDataConn), (u8 *)ble_advDataConn);
+		blc_ll_setExtScanRspData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, sizeof(ble_scanRsp), (u8 *)ble_scanRsp);
+	}
+	if (adv_mode == BLE_ADV_MODE_SensorData)
+	{	// non-connectable ext adv, primary and secondary channel on LE Coded
+		u8 coding=app_config_get_advoption(ADVOPT_CODING);
+		DEBUGFMT(APP_BLE_LOG_EN, "[BLE] Start ADVext SensorData (coded %s)", (coding == ADV_CODING_S2) ? "S2" : "S8");
+		ret = blc_ll_setExtAdvParam(ADV_HANDLE0, ADV_EVT_PROP_EXTENDED_NON_CONNECTABLE_NON_SCANNABLE_UNDIRECTED,
+				SENSORDATA_ADV_INTERVAL, SENSORDATA_ADV_INTERVAL+(SENSORDATA_ADV_INTERVAL/10), BLT_ENABLE_ADV_ALL,
+				ble_own_address_type, 0, NULL, ADV_FP_NONE, tx_power,
+				BLE_PHY_CODED, 0, BLE_PHY_CODED, ADV_SID_0, 0);
+		blc_ll_setDefaultExtAdvCodingIndication(ADV_HANDLE0, (coding == ADV_CODING_S2) ? CODED_PHY_PREFER_S2 : CODED_PHY_PREFER_S8);
+		ble_advSensorDataLen=0; ble_build_adv_sensordata(); // complete rebuild
+		blc_ll_setExtAdvData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, ble_advSensorDataLen, ble_advSensorData);
+	}
+	if (ret == BLE_SUCCESS && adv_mode != BLE_ADV_MODE_None)
+		blc_ll_setExtAdvEnable_1(BLC_ADV_ENABLE, 1, ADV_HANDLE0, 0, 0);
+	return ret;
+}
+#endif
+
+// update adv data (legacy or ext adv)
+static void ble_adv_set_data(const u8 *data, u8 len)
+{
+	#if (BLE_EXT_ADV_CODED_ENABLE)
+	if (ble_ext_adv)
+	{
+		blc_ll_setExtAdvData(ADV_HANDLE0, DATA_OPER_COMPLETE, DATA_FRAGM_ALLOWED, len, (u8 *)data);
+		blc_ll_setExtAdvEnable_1(BLC_ADV_ENABLE, 1, ADV_HANDLE0, 0, 0);
+		return;
+	}
+	#endif
+	bls_ll_setAdvData((u8 *)data, len);
+	bls_ll_setAdvEnable(BLC_ADV_ENABLE);
+}
+
+// publish the build buffer (swapped in by the adv prepare callback)
+static void ble_adv_payload_commit(void)
+{
+	#if (BLE_EXT_ADV_CODED_ENABLE)
+	if (ble_ext_adv)
+	{	// no adv prepare callback
+		ble_adv_set_data(ble_advSensorData, ble_advSensorDataLen);
+		return;
+	}
+	#endif
+	u8 r=irq_disable(); // payload, length and encryption state complete before the swap
+	ble_adv_payload_len[ble_adv_payload_idx]=ble_advSensorDataLen;
+	ble_adv_payload_swap=1;
+	irq_restore(r);
+	if (ble_adv_trigger)
+		bls_ll_setAdvEnable(BLC_ADV_ENABLE); // adv is off between bursts
+}
+
 // setup adv for different states
 _attribute_optimize_size_ void app_ble_setup_adv(u8 adv_mode)
 {
 	u8 adv_enable=BLC_ADV_DISABLE; ble_sts_t adv_param_ret=BLE_SUCCESS; smp_param_save_t bondInfo;
 	u8 bond_number = blc_smp_param_getCurrentBondingDeviceNumber();  // get bonded device number
+	ble_adv_interval = 0; ble_adv_interval_events = 0; ble_adv_trigger = ADV_TRIGGER_OFF; ble_adv_push = ADV_PUSH_OFF;
+	ble_adv_base = 0; ble_adv_phase = 0; ble_adv_phase_on = 0; ble_adv_scanrsp = ADV_SCANRSP_DEFAULT;
+	ble_adv_channels = ADV_CHANNELS_ALL; ble_adv_channel_idx = 0;
+	#if (BLE_EXT_ADV_CODED_ENABLE)
+	if (ble_ext_adv)
+	{
+		ble_adv_connectable=0; adv_param_ret=ble_ext_adv_setup(adv_mode);
+		if (adv_param_ret!=BLE_SUCCESS)
+			DEBUGFMT(APP_BLE_LOG_EN, "[BLE] ERROR: ext ADV param 0x%x", adv_param_ret);
+		rf_set_power_level_index(ble_rf_power_level);
+		ble_adv_mode = adv_mode;
+		return;
+	}
+	#endif
 	bls_smp_param_loadByIndex(bond_number-1, &bondInfo); // get the latest bonding device
 	if(bond_number > 0 && isIrkValid(bondInfo.peer_irk))
 	{
@@ -783,7 +1826,12 @@ _attribute_optimize_size_ void app_ble_setup_adv(u8 adv_mode)
 	if (adv_mode == BLE_ADV_MODE_SensorData)
 	{  // ADV with BTHome data
 		u8 devmode=app_config_get_mode();
-		enum {DEVMODE_DEFAULT=0, DEVMODE_MEASURE_NOCONN=0, DEVMODE_MEASURE_CONN, DEVMODE_LAST};
+		ble_adv_channels=app_config_get_advoption(ADVOPT_CHANNELS); // channel rotation
+		if (ble_adv_channels >= ADV_CHANNELS_LAST)   ble_adv_channels=ADV_CHANNELS_ALL;
+		u8 channels=ble_adv_channel_maps[ble_adv_channels][0];
+		ble_adv_connectable=(bond_number > 0 && devmode == DEVMODE_MEASURE_CONN);
+		u8 scanrsp=app_config_get_advoption(ADVOPT_SCANRSP);
+		u8 advtype=(scanrsp != ADV_SCANRSP_DEFAULT) ? ADV_TYPE_SCANNABLE_UNDIRECTED : ADV_TYPE_NONCONNECTABLE_UNDIRECTED;
 		if (bond_number > 0 && devmode == DEVMODE_MEASURE_CONN)
 		{   // note: direct adv
 			DEBUGSTR(APP_BLE_LOG_EN, "[BLE] Start ADVind SensorData");
@@ -791,24 +1839,61 @@ _attribute_optimize_size_ void app_ble_setup_adv(u8 adv_mode)
 					SENSORDATA_CONN_ADV_INTERVAL, SENSORDATA_CONN_ADV_INTERVAL+(SENSORDATA_ADV_INTERVAL/10),
 					ADV_TYPE_CONNECTABLE_UNDIRECTED, ble_own_address_type,
 					bondInfo.peer_addr_type,  bondInfo.peer_addr,
+					channels,	ADV_FP_NONE);
+			#if (SENSORDATA_ADV_SPREAD)
+			ble_adv_spread_init(SENSORDATA_CONN_ADV_INTERVAL);
+			#endif
+		}
+		else if (bond_number > 0 && devmode == DEVMODE_MEASURE_PUSH)
+		{   // note: directed adv to the bonded gateway, enabled on data change
+			DEBUGSTR(APP_BLE_LOG_EN, "[BLE] Start ADVdirect SensorData (push)");
+			ble_adv_push=ADV_PUSH_IDLE; ble_adv_push_pending=1; // first push
+			adv_param_ret = bls_ll_setAdvParam(
+					ADV_INTERVAL_10MS, ADV_INTERVAL_10MS, // not used (high duty)
+					ADV_TYPE_CONNECTABLE_DIRECTED_HIGH_DUTY, ble_own_address_type,
+					bondInfo.peer_addr_type,  bondInfo.peer_addr,
 					BLT_ENABLE_ADV_ALL,	ADV_FP_NONE);
 		}
+		else if (devmode == DEVMODE_MEASURE_TRIGGER)
+		{   // note: adv burst on data change
+			DEBUGSTR(APP_BLE_LOG_EN, "[BLE] Start ADVnoconn SensorData (trigger based)");
+			ble_adv_trigger=ADV_TRIGGER_BURST; ble_adv_trigger_time=app_sec_time();
+			adv_param_ret = bls_ll_setAdvParam(
+					SENSORDATA_TRIGGER_ADV_INTERVAL, SENSORDATA_TRIGGER_ADV_INTERVAL+(SENSORDATA_TRIGGER_ADV_INTERVAL/10),
+					advtype,
+					ble_own_address_type,
+					0,  NULL, channels, ADV_FP_NONE);
+			#if (SENSORDATA_ADV_SPREAD)
+			ble_adv_spread_init(SENSORDATA_TRIGGER_ADV_INTERVAL);
+			#endif
+		}
 		else // DEVMODE_MEASURE_NOCONN
 		{
 			DEBUGSTR(APP_BLE_LOG_EN, "[BLE] Start ADVnoconn SensorData");
+			u16 interval=SENSORDATA_ADV_INTERVAL;
+			#if (SENSORDATA_ADV_ADAPTIVE)
+			interval=SENSORDATA_ADV_INTERVAL_FAST; ble_adv_interval=interval; // start with fast interval
+			#endif
 			adv_param_ret = bls_ll_setAdvParam(
-					SENSORDATA_ADV_INTERVAL, SENSORDATA_ADV_INTERVAL+(SENSORDATA_ADV_INTERVAL/10),
-					ADV_TYPE_NONCONNECTABLE_UNDIRECTED,
+					interval, interval+(interval/10),
+					advtype,
 					ble_own_address_type,
-					0,  NULL, BLT_ENABLE_ADV_ALL, ADV_FP_NONE);
+					0,  NULL, channels, ADV_FP_NONE);
+			#if (SENSORDATA_ADV_SPREAD)
+			ble_adv_spread_init(interval);
+			#endif
 		}
-		ble_build_adv_sensordata();
-		bls_ll_setScanRspData((u8 *)ble_scanRsp,sizeof(ble_scanRsp));
+		if (ble_adv_connectable || scanrsp != ADV_SCANRSP_DEFAULT)
+			bls_ll_setScanRspData((u8 *)ble_scanRsp,sizeof(ble_scanRsp)); // ADV_SCANRSP_DATA: updated by the BTHome V2 builder
+		else
+			bls_ll_setScanRspData(NULL, 0); // non-connectable: no scan response
+		ble_adv_scanrsp=(ble_adv_push) ? ADV_SCANRSP_DEFAULT : scanrsp; // push: voltage in the notified data
+		ble_advSensorDataLen=0; ble_build_adv_sensordata(); // complete rebuild
+		ble_adv_payload_commit(); // also swapped in at the first adv event (buffer state)
 		bls_ll_setAdvData(ble_advSensorData, ble_advSensorDataLen);
 		bls_ll_setAdvDuration(0, 0); // disable adv duration
 		bls_set_advertise_prepare(ble_advertise_prepare_handler); // ll_adv.h
-		sensor_data_sendcount = 0;
-		adv_enable=BLC_ADV_ENABLE;
+		adv_enable=(ble_adv_push) ? BLC_ADV_DISABLE : BLC_ADV_ENABLE; // push: adv on data change
 	}
 	if (adv_param_ret!=BLE_SUCCESS)
 	{
@@ -868,6 +1953,11 @@ _attribute_optimize_size_ void app_ble_init_normal(void)
 	DEBUGFMT(APP_LOG_EN, "[BLE] Public MAC Address %02X:%02X:%02X:%02X:%02X:%02X",
 		ble_mac_public[5], ble_mac_public[4], ble_mac_public[3],
 		ble_mac_public[2], ble_mac_public[1], ble_mac_public[0]);
+	// sensor data filter (from config)
+	app_ble_setup_datafilter();
+	// BTHome counter (continue after reboot, must: after battery check)
+	sensor_data_sendcount=app_flash_counter_init();
+	sensor_data_sendcount_end=app_flash_counter_reserve(sensor_data_sendcount);
     // MAC address type
 	#if (BLE_DEVICE_ADDRESS_TYPE == BLE_DEVICE_ADDRESS_PUBLIC)
 		ble_own_address_type = OWN_ADDRESS_PUBLIC;
@@ -878,6 +1968,11 @@ _attribute_optimize_size_ void app_ble_init_normal(void)
     // BLE controller basics
 	blc_ll_initBasicMCU(); // mandatory
 	blc_ll_initStandby_module(ble_mac_public);		// mandatory
+	#if (BLE_EXT_ADV_CODED_ENABLE)
+	if (app_config_get_mode() == DEVMODE_MEASURE_CODED)
+		ble_ext_adv_init(); // extended advertising module (instead of legacy module)
+	else
+	#endif
 	blc_ll_initAdvertising_module(ble_mac_public);	// legacy advertising module: mandatory for BLE slave
 	blc_ll_initConnection_module();					// connection module: mandatory for BLE slave/master
 	blc_ll_initSlaveRole_module();					// slave module: mandatory for BLE slave,
@@ -914,6 +2009,9 @@ _attribute_optimize_size_ void app_ble_init_normal(void)
 	blc_ota_registerOtaStartCmdCb(app_enter_ota_mode);
 	blc_ota_registerOtaResultIndicationCb(app_ota_end_result);
 	#endif
+	#if (APP_CCM_DEBUG_EN)
+	ble_bthome_encrypt_benchmark();
+	#endif
 	// ADV setup
 	ble_setup_adv_localname(0, ble_mac_public, ble_scanRsp, sizeof(ble_scanRsp));
 	app_ble_setup_adv(BLE_ADV_MODE_Conn);
@@ -921,6 +2019,7 @@ _attribute_optimize_size_ void app_ble_init_normal(void)
 	// Host callbacks
 	bls_app_registerEventCallback (BLT_EV_FLAG_CONNECT, &ble_task_connect);
 	bls_app_registerEventCallback (BLT_EV_FLAG_TERMINATE, &ble_task_terminate);
+	bls_app_registerEventCallback (BLT_EV_FLAG_SCAN_RSP, &ble_task_scan_rsp);
 	bls_app_registerEventCallback (BLT_EV_FLAG_SUSPEND_ENTER, &ble_task_sleep_enter);
 	bls_app_registerEventCallback (BLT_EV_FLAG_SUSPEND_EXIT, &ble_task_suspend_exit);
 	bls_app_registerEventCallback (BLT_EV_FLAG_DATA_LENGTH_EXCHANGE, &ble_task_dle_exchange);
@@ -932,24 +2031,88 @@ _attribute_ram_code_ void app_ble_init_deepRetn(void)
 	rf_set_power_level_index(ble_rf_power_level); // not stored during deep sleep
 }
 
+// returns 1: next adv event needs the info packet, or the sensor data after it (rebuild without data change)
+static u8 ble_adv_devinfo_check(void)
+{
+	u8 datafmt=app_config_get_dataformat()&DATAFORMAT_MASK;
+	if ((datafmt != DATAFORMAT_DEFAULT && datafmt != DATAFORMAT_BTHOME_V2 && datafmt != DATAFORMAT_MIXED) ||
+		ble_adv_push || ble_adv_trigger == ADV_TRIGGER_IDLE)
+	{	// no BTHome V2 or no adv events
+		if (ble_adv_devinfo == ADV_DEVINFO_ONAIR)   ble_adv_devinfo=ADV_DEVINFO_OFF;
+		return 0;
+	}
+	#if (BLE_EXT_ADV_CODED_ENABLE)
+	if (ble_ext_adv)   return 0; // no adv prepare callback (adv events not counted)
+	#endif
+	if ((sensor_data.flags&DATA_FLAGS_DATAVALID)==0)   return 0;
+	if (ble_adv_devinfo == ADV_DEVINFO_ONAIR)
+	{	// sent once: back to sensor data
+		if (ble_adv_payload_swap || ble_adv_event_cnt == ble_adv_devinfo_event)   return 0;
+		ble_adv_devinfo=ADV_DEVINFO_OFF;
+		return 1;
+	}
+	if (ble_adv_devinfo == ADV_DEVINFO_OFF)
+	{
+		if (!(SENSORDATA_DEVINFO_EVENTS && ble_adv_event_cnt-ble_adv_devinfo_event >= SENSORDATA_DEVINFO_EVENTS) &&
+			!(SENSORDATA_DEVINFO_SEC && app_sec_time_exceeds(ble_adv_devinfo_time, SENSORDATA_DEVINFO_SEC)))
+			return 0;
+		ble_adv_devinfo=ADV_DEVINFO_PENDING;
+	}
+	return 1;
+}
+
 // ble main loop
 u8 app_ble_loop(void)
 {
 	// check for BTHome value changes and update adv data
 	if (ble_adv_mode == BLE_ADV_MODE_SensorData)
 	{
+		// pending filtered values (hold time)
+		sensordata_filter_loop();
+		// reserve next counter block in time (not on low battery: no flash writes, encryption stops at the reserved end)
+		if (sensor_data_sendcount_end-sensor_data_sendcount < APP_FLASH_COUNTER_BLOCK/2 &&
+			(app_flash_get_persist_state()&APP_STATE_LOWBAT) == 0)
+			sensor_data_sendcount_end=app_flash_counter_reserve(sensor_data_sendcount_end);
+		// trigger based: heartbeat
+		if (ble_adv_trigger && app_sec_time_exceeds(ble_adv_trigger_time, SENSORDATA_TRIGGER_HEARTBEAT_SEC))
+			sensor_data.flags|=DATA_FLAG_CHANGED;
+		// device info packet, per object cadence: rotate payload
+		u8 rotate=0;
+		if ((sensor_data.flags&DATA_FLAG_CHANGED)==0 && (ble_adv_devinfo_check() || ble_adv_cadence_check()))
+		{
+			rotate=1; sensor_data.flags|=DATA_FLAG_CHANGED;
+		}
 		int ret=ble_build_adv_sensordata();
 		if (ret > 0)
 		{   // data changed
-			bls_ll_setAdvData(ble_advSensorData, ble_advSensorDataLen);
-			bls_ll_setAdvEnable(BLC_ADV_ENABLE);
+			DEBUGFMT(APP_BTHOME_LOG_EN, "[BLE] BTHome data %s (adv pdu %u bytes, event encryption max. %u us)",
+				rotate ? "rotated" : "changed", 2+6+ble_advSensorDataLen, bthome_event_crypt_ticks/CLOCK_16M_SYS_TIMER_CLK_1US);
+			ble_adv_payload_commit();
 		}
-		if (ret < 0)
-		{   // adv data error
-			bls_ll_setAdvData((u8*)ble_advDataError, sizeof(ble_advDataError));
-			bls_ll_setAdvEnable(BLC_ADV_ENABLE);
+		#if (SENSORDATA_ADV_ADAPTIVE)
+		if (ble_adv_interval)
+			ble_adv_interval_update(ret > 0 && !rotate);
+		#endif
+		if (ble_adv_trigger)
+			ble_adv_trigger_update(ret > 0 && !rotate);
+		if (ble_adv_push)
+			ble_adv_push_update(ret > 0 && !rotate);
+		if (ret < 0 && !ble_adv_push)
+		{   // adv data error (no event encryption, no mixed payloads)
+			u8 r=irq_disable();
+			bthome_event_crypt[0].key=0; bthome_event_crypt[1].key=0;
+			ble_adv_payload_alt_len[0]=0; ble_adv_payload_alt_len[1]=0;
+			ble_adv_mix_ratio=0; ble_adv_payload_alt_on=0;
+			irq_restore(r);
+			ble_adv_set_data(ble_advDataError, sizeof(ble_advDataError));
 		}
+		#if (BTHOME_ENCRYPT_PER_EVENT)
+		ble_bthome_keystream_prepare();
+		#endif
 	}
+	#if (BLE_TXPOWER_CALIBRATION)
+	ble_txcal_loop();
+	#endif
 	// connection timeout
 	if (ble_device_connection_state!=DEV_CONN_STATE_NONE && ble_connection_timeout!=0 &&
 		ble_ota_is_working == BLE_OTA_NONE &&
@@ -21,7 +21,17 @@
 #ifndef __APP_CONFIG_H__INCLUDED__
 #define __APP_CONFIG_H__INCLUDED__
 
-#define VERSION_STR "V1.0"
+#define VERSION_MAJOR 1 // firmware version (BTHome firmware version object, VERSION_STR)
+#define VERSION_MINOR 0
+#define VERSION_PATCH 0
+
+#define VERSION_STRINGIFY(v) #v
+#define VERSION_TOSTR(v) VERSION_STRINGIFY(v)
+#if (VERSION_PATCH)
+#define VERSION_STR "V" VERSION_TOSTR(VERSION_MAJOR) "." VERSION_TOSTR(VERSION_MINOR) "." VERSION_TOSTR(VERSION_PATCH)
+#else
+#define VERSION_STR "V" VERSION_TOSTR(VERSION_MAJOR) "." VERSION_TOSTR(VERSION_MINOR) // "V1.0"
+#endif
 
 #if defined(APP_DEBUG_ENABLE) && (APP_DEBUG_ENABLE)
 #define VERSION_STR_BUILD "debug"
@@ -31,6 +41,23 @@
 
 #define SENSORDATA_ADV_INTERVAL 		(ADV_INTERVAL_1S * 8)  // 8 sec, ADV mode noconn (max. 8s)
 #define SENSORDATA_CONN_ADV_INTERVAL	(ADV_INTERVAL_1S * 3)  // 3 sec, ADV mode direct
+#define SENSORDATA_ADV_ADAPTIVE			0 // ADV mode noconn: fast interval after data changes, back-off to SENSORDATA_ADV_INTERVAL
+#define SENSORDATA_ADV_INTERVAL_FAST	(ADV_INTERVAL_1S / 5)  // 200 ms
+#define SENSORDATA_ADV_FAST_EVENTS		10 // adv events with fast interval after a data change
+#define SENSORDATA_ADV_BACKOFF_EVENTS	3  // adv events per back-off step (interval doubled)
+#define SENSORDATA_TRIGGER_ADV_INTERVAL	(ADV_INTERVAL_1S / 10) // 100 ms, ADV mode trigger based (burst)
+#define SENSORDATA_TRIGGER_EVENTS		8  // adv events per burst
+#define SENSORDATA_TRIGGER_HEARTBEAT_SEC (10*60) // 10 min, burst without data change
+#define SENSORDATA_TRIGGER_WAKEUP_SEC	60 // app wakeup when advertising is off (check heartbeat, MCU data timeout)
+#define SENSORDATA_PUSH_ADV_MS			1280 // ADV mode push: directed adv (high duty) to the bonded gateway
+#define SENSORDATA_PUSH_CONN_MS			3000 // max. connection time per push (encryption + notify)
+#define SENSORDATA_PUSH_HEARTBEAT_SEC	(30*60) // 30 min, push without data change
+#define SENSORDATA_DEVINFO_EVENTS		450 // BTHome V2: device info packet (firmware versions) every n-th adv event (0: off)
+#define SENSORDATA_DEVINFO_SEC			(60*60) // 1 hour, device info packet at least once per interval (0: off)
+#define SENSORDATA_MINIMAL_SLOW_CNT		8 // DATAFORMAT_OPT_MINIMAL: send unchanged slow objects (voltage) every n-th packet
+#define SENSORDATA_ADV_SPREAD			0  // MAC-seeded phase offset at adv start + adv interval range (many devices, same interval)
+#define SENSORDATA_ADV_JITTER_PCT		10 // SENSORDATA_ADV_SPREAD: adv interval range (% of interval)
+#define SENSORDATA_ADV_CHANNELS			0 // default (GATT "Adv Options"): 0 all channels, 1/2 channels per event (rotating)
 #define BLE_CONNECTION_TIMEOUT_SEC		(4*60) // 4 min
 #define APP_MCU_DATA_TIMEOUT_SEC        (3*60) // 3 min (poll data from MCU, if not got a data notify)
 
@@ -46,9 +73,32 @@
 #define BLE_OTA_SERVER_ENABLE			1
 #define BLE_ATT_CUSTOMCONFIG            1 // BLE ATT "PowerLevel" "DeviceMode" "DataFormat"
 #define BLE_ATT_CRYPTKEY_CHANGE_ENABLE	1 // Allow to change BTHome encryption key
+#define BTHOME_ENCRYPT_PER_EVENT		0 // BTHome V2: encrypt data with the rolling counter on every advertising event
+#define BTHOME_ENCRYPT_EVENT_BUDGET_US	300 // max. time for encryption in the adv prepare callback (else fall back)
+#define BLE_EXT_ADV_CODED_ENABLE		0 // device mode "coded": BTHome data as extended adv on LE Coded PHY (S2/S8, long range)
+#define XIAOMI_ENCRYPT_CONN_BATTERY		0 // Xiaomi encrypted with adv flags (connectable or not DATAFORMAT_OPT_MINIMAL): 31 bytes fit 2 of 3 objects, 0: temp + moisture, 1: temp + battery
+
+// Sensor data filter defaults (GATT "Data Filter"), 0: off (every change is sent):
+//   abs. deadband (value units), rel. deadband (0.1 %), min. hold time (sec)
+#define SENSORDATA_FILTER_BAT			0, 0, 0		// value unit 1 %
+#define SENSORDATA_FILTER_TEMP			0, 0, 0		// value unit 0.01 C (e.g. 20: 0.2 C)
+#define SENSORDATA_FILTER_VOLT			0, 0, 0		// value unit 0.001 V (e.g. 50: 50 mV)
+#define SENSORDATA_FILTER_MOIST			0, 0, 0		// value unit 0.01 %
+
+// Sensor data cadence defaults (GATT "Data Cadence"):
+//   send object every n-th adv event (0: every event), | 0x80: and if changed
+#define SENSORDATA_CADENCE_BAT			0
+#define SENSORDATA_CADENCE_TEMP			0
+#define SENSORDATA_CADENCE_VOLT			0
+#define SENSORDATA_CADENCE_MOIST		0
 
 // RF Power Level
 #define RF_POWER_LEVEL_DEFAULT 3 // dbm
+#define BLE_TXPOWER_CALIBRATION		0   // step TX power down while connected to the bonded gateway, use lowest reliable level for adv
+#define BLE_TXCAL_STEP_MS			2000 // time per level
+#define BLE_TXCAL_PROBES			4   // probe notifications per level (BTHome data)
+#define BLE_TXCAL_LOSS_EVENTS		2   // max. extra connection events (retransmissions) for the probes
+#define BLE_TXCAL_OFFSET_DB			4   // safety offset for adv
 
 // Deep save register
 #define USED_DEEP_ANA_REG	DEEP_ANA_REG0	// u8, can save 8 bit info when deep
@@ -83,6 +133,7 @@
 #define APP_SERIAL_LOG_EN					1
 #define APP_SERIAL_DEBUG_EN					1
 #define APP_BTHOME_LOG_EN					1
+#define APP_CCM_DEBUG_EN					1  // CCM fast path check + benchmark at start
 #define APP_DPDATA_LOG_EN					0
 #define APP_SECTIMER_DEBUG_EN				1
 #endif
@@ -105,6 +156,10 @@
 #define UART_TX_PIN		UART_TX_PB1
 #define UART_RX_PIN		UART_RX_PB7
 #define UART_BAUDRATE	9600
+#define MCU_SERIAL_RX_IRQ	1 // UART RX IRQ feeds a ring buffer, CPU stall between bytes (instead of polling the FIFO)
+#define MCU_SERIAL_TX_DMA	1 // UART TX packets by DMA, CPU stall until TX done IRQ (instead of filling the FIFO)
+#define MCU_RXBUF_CNT		3 // receive packet queue (MCU sends packets back to back, e.g. ReportStatus after heartbeat)
+#define MCU_RESP_TIMEOUT_ADAPTIVE 1 // MCU response timeout from measured latency (fixed timeout until enough samples)
 
 // Idle/WakeUp Pins
 #define MODULE_WAKEUP_PIN	GPIO_PB5 // high to wake up module to receive notifications
@@ -26,7 +26,9 @@
 //    Calibration:    0x77000
 //    FW SgnKey:     0x77180
 //    Master Pairing: 0x78000 (unused)
+//    App Counter B:  0x7B000
 //    App Config.:    0x7C000
+//    App Counter:    0x7D000
 
 #ifndef APP_FLASH_LOG_EN
 #define APP_FLASH_LOG_EN 0
@@ -41,8 +43,14 @@
 
 #define CFG_ADR_APP_512K_FLASH 0x7c000
 #define CFG_ADR_APP_1M_FLASH 0xfa000
+#define CNT_ADR_APP_512K_FLASH 0x7d000
+#define CNT_ADR_APP_1M_FLASH 0xfb000
+#define CNT2_ADR_APP_512K_FLASH 0x7b000
+#define CNT2_ADR_APP_1M_FLASH 0xf9000
 
 _attribute_data_retention_	unsigned int flash_sector_app_config = CFG_ADR_APP_512K_FLASH;
+_attribute_data_retention_	unsigned int flash_sector_app_counter = CNT_ADR_APP_512K_FLASH;
+_attribute_data_retention_	unsigned int flash_sector_app_counter2 = CNT2_ADR_APP_512K_FLASH;
 
 // we use files from the BLE SDK vendor section "inline"
 #include "vendor/common/ble_flash.h"
@@ -62,8 +70,14 @@ void app_flash_init_normal(void)
 	// flash config sector
 	flash_sector_app_config = CFG_ADR_APP_512K_FLASH;
 	if (blc_flash_capacity == FLASH_SIZE_1M)   flash_sector_app_config = CFG_ADR_APP_1M_FLASH;
+	// flash counter sector
+	flash_sector_app_counter = CNT_ADR_APP_512K_FLASH;
+	if (blc_flash_capacity == FLASH_SIZE_1M)   flash_sector_app_counter = CNT_ADR_APP_1M_FLASH;
+	flash_sector_app_counter2 = CNT2_ADR_APP_512K_FLASH;
+	if (blc_flash_capacity == FLASH_SIZE_1M)   flash_sector_app_counter2 = CNT2_ADR_APP_1M_FLASH;
     DEBUGFMT(APP_FLASH_DEBUG_EN, "[FLS] Flash init: MAC at %X", flash_sector_mac_address );
     DEBUGFMT(APP_FLASH_DEBUG_EN, "[FLS] Flash init: CONFIG at %X", flash_sector_app_config );
+    DEBUGFMT(APP_FLASH_DEBUG_EN, "[FLS] Flash init: COUNTER at %X/%X", flash_sector_app_counter, flash_sector_app_counter2 );
 }
 
 _attribute_ram_code_ void app_flash_init_deepRetn(void)
@@ -153,7 +167,7 @@ asm(".global __PM_DEEPSLEEP_RETENTION_ENABLE");
 //      write 256 bytes:  1.3 ms
 
 #define APP_CFG_MAGIC 0x70706168
-#define APP_CFG_VERSION 1
+#define APP_CFG_VERSION 2
 
 typedef struct _attribute_packed_ _appconfig_v0_t {
 	u32 magic; // magic to check if config is valid
@@ -176,7 +190,25 @@ typedef struct _attribute_packed_ _appconfig_v1_t {
 	u8  reserved2;
 } appconfig_v1_t;
 
-#define appconfig_t appconfig_v1_t
+typedef struct _attribute_packed_ _appconfig_v2_t {
+	u32 magic; // magic to check if config is valid
+	u16 version; // =2
+	u16 reserved1; // reserved for future use
+	u8  bth_key_init[16];
+	// config values
+	u8  bth_key_gatt[16];
+	u32 pincode;
+	u8  powerlevel; // dbm + 30
+	u8  mode;
+	u8  dataformat;
+	u8  reserved2;
+	sensor_filter_t datafilter[SENSOR_OBJ_CNT];
+	u8  advoptions[ADVOPT_CNT];
+	u8  datacadence[SENSOR_OBJ_CNT];
+	u8  txcal_level; // dbm + 30 (calibrated adv power level)
+} appconfig_v2_t;
+
+#define appconfig_t appconfig_v2_t
 
 #define APP_CFG_DEFAULT_U8  0xFF
 #define APP_CFG_DEFAULT_U16 0xFFFF
@@ -259,6 +291,7 @@ void app_config_init(void)
 	    	len_org=sizeof(appconfig_v1_t);
 	    if (len_org>0 && len_org<sizeof(app_config))
 	    	memset(pcfg+len_org, APP_CFG_DEFAULT_U8, sizeof(app_config)-len_org);
+		app_config.version = APP_CFG_VERSION;
 		app_config_dirty = APP_CFG_DIRTY_ALL;
 	}
 	app_config_flush();
@@ -371,6 +404,22 @@ void app_config_set_power_level(signed char level_dbm)
 	if (level_dbm < -30)   level_dbm=-30;
 	volatile u8 powerlevel=(u8)(level_dbm + 30);
 	config_set_val((u8*)&app_config.powerlevel, (u8*)&powerlevel, 1);
+	u8 txcal=APP_CFG_DEFAULT_U8; // new max. level: calibrate again
+	config_set_val((u8*)&app_config.txcal_level, &txcal, 1);
+}
+
+signed char app_config_get_txcal_level(void)
+{
+	if (app_config.txcal_level == APP_CFG_DEFAULT_U8 )   return APP_TXCAL_NONE;
+	return ((signed char)app_config.txcal_level) - 30;
+}
+
+void app_config_set_txcal_level(signed char level_dbm)
+{
+	if (level_dbm > 30)   level_dbm=30;
+	if (level_dbm < -30)   level_dbm=-30;
+	volatile u8 txcal=(u8)(level_dbm + 30);
+	config_set_val((u8*)&app_config.txcal_level, (u8*)&txcal, 1);
 }
 
 u8 app_config_get_mode(void)
@@ -396,6 +445,195 @@ void app_config_set_dataformat(u8 datafmt)
 	config_set_val((u8*)&app_config.dataformat, (u8*)&datafmt, 1);
 }
 
+#ifndef SENSORDATA_FILTER_BAT
+#define SENSORDATA_FILTER_BAT	0, 0, 0
+#define SENSORDATA_FILTER_TEMP	0, 0, 0
+#define SENSORDATA_FILTER_VOLT	0, 0, 0
+#define SENSORDATA_FILTER_MOIST	0, 0, 0
+#endif
+
+static const sensor_filter_t app_config_datafilter_default[SENSOR_OBJ_CNT] = {
+	{SENSORDATA_FILTER_BAT}, {SENSORDATA_FILTER_TEMP}, {SENSORDATA_FILTER_VOLT}, {SENSORDATA_FILTER_MOIST}
+};
+
+void app_config_get_datafilter(sensor_filter_t *filter)
+{
+	for (u8 u=0; u<SENSOR_OBJ_CNT; u++)
+	{
+		const sensor_filter_t *f=&app_config.datafilter[u], *fd=&app_config_datafilter_default[u];
+		filter[u].abs  = (f->abs == APP_CFG_DEFAULT_U16) ? fd->abs : f->abs;
+		filter[u].rel  = (f->rel == APP_CFG_DEFAULT_U8) ? fd->rel : f->rel;
+		filter[u].hold = (f->hold == APP_CFG_DEFAULT_U8) ? fd->hold : f->hold;
+	}
+}
+
+void app_config_set_datafilter(const sensor_filter_t *filter)
+{
+	config_set_val((u8*)app_config.datafilter, (const u8*)filter, sizeof(app_config.datafilter));
+}
+
+#ifndef SENSORDATA_CADENCE_BAT
+#define SENSORDATA_CADENCE_BAT		0
+#define SENSORDATA_CADENCE_TEMP		0
+#define SENSORDATA_CADENCE_VOLT		0
+#define SENSORDATA_CADENCE_MOIST	0
+#endif
+
+static const u8 app_config_datacadence_default[SENSOR_OBJ_CNT] = {
+	SENSORDATA_CADENCE_BAT, SENSORDATA_CADENCE_TEMP, SENSORDATA_CADENCE_VOLT, SENSORDATA_CADENCE_MOIST
+};
+
+void app_config_get_datacadence(u8 *cadence)
+{
+	for (u8 u=0; u<SENSOR_OBJ_CNT; u++)
+		cadence[u] = (app_config.datacadence[u] == APP_CFG_DEFAULT_U8) ? app_config_datacadence_default[u] : app_config.datacadence[u];
+}
+
+void app_config_set_datacadence(const u8 *cadence)
+{
+	config_set_val(app_config.datacadence, cadence, SENSOR_OBJ_CNT);
+}
+
+#ifndef SENSORDATA_ADV_CHANNELS
+#define SENSORDATA_ADV_CHANNELS ADV_CHANNELS_ALL
+#endif
+
+static const u8 app_config_advoptions_default[ADVOPT_CNT] = { SENSORDATA_ADV_CHANNELS, 0, 0, 0 };
+
+u8 app_config_get_advoption(u8 idx)
+{
+	if (idx >= ADVOPT_CNT)   return 0;
+	if (app_config.advoptions[idx] == APP_CFG_DEFAULT_U8)   return app_config_advoptions_default[idx];
+	return app_config.advoptions[idx];
+}
+
+void app_config_get_advoptions(u8 *opt)
+{
+	for (u8 u=0; u<ADVOPT_CNT; u++)
+		opt[u]=app_config_get_advoption(u);
+}
+
+void app_config_set_advoptions(const u8 *opt)
+{
+	u8 o[ADVOPT_CNT]; memcpy(o, opt, ADVOPT_CNT);
+	if (o[ADVOPT_CHANNELS] >= ADV_CHANNELS_LAST)   o[ADVOPT_CHANNELS]=ADV_CHANNELS_ALL;
+	if (o[ADVOPT_SCANRSP] >= ADV_SCANRSP_LAST)   o[ADVOPT_SCANRSP]=ADV_SCANRSP_DEFAULT;
+	if (o[ADVOPT_CODING] >= ADV_CODING_LAST)   o[ADVOPT_CODING]=ADV_CODING_S8;
+	config_set_val(app_config.advoptions, o, ADVOPT_CNT);
+}
+
+//
+// app counter (monotonic, e.g. BTHome encryption counter)
+//
+// note:
+//  - the counter is reserved in blocks of APP_FLASH_COUNTER_BLOCK values
+//  - each reserved block clears one bit in the counter sector (bitmap after the header)
+//  - two counter sectors (A/B): a new base (all bits used, ~134M counter values) is written
+//    to the other sector, the active sector stays valid until the new header is written
+//  - after reboot the counter continues at the end of the last reserved block of the
+//    sector with the larger counter (power loss while erasing never restarts at 0)
+
+#define APP_CNT_MAGIC 0x746e6361
+#define APP_CNT_SECTOR_SIZE 4096
+
+typedef struct _attribute_packed_ _appcounter_hdr_t {
+	u32 magic; // magic to check if counter sector is valid
+	u32 base; // counter value of first block
+} appcounter_hdr_t;
+
+#define APP_CNT_BITMAP_OFS   sizeof(appcounter_hdr_t)
+#define APP_CNT_BITMAP_LEN   (APP_CNT_SECTOR_SIZE-APP_CNT_BITMAP_OFS)
+#define APP_CNT_BLOCKS_MAX   (APP_CNT_BITMAP_LEN*8)
+
+_attribute_data_retention_	u32 app_counter_sector = 0; // active counter sector (A/B)
+_attribute_data_retention_	u32 app_counter_base = 0;
+_attribute_data_retention_	u16 app_counter_blocks = 0; // reserved blocks (cleared bits)
+
+// read counter sector, returns 0 if the header is invalid
+static u8 counter_sector_read(u32 sector, u32 *base, u16 *blocks)
+{
+	appcounter_hdr_t hdr;
+	flash_read_page(sector, sizeof(hdr), (u8 *)&hdr);
+	if (hdr.magic != APP_CNT_MAGIC)   return 0;
+	// bitmap bytes are cleared in order: binary search first byte not 0x00
+	u16 lo=0, hi=APP_CNT_BITMAP_LEN; u8 b;
+	while (lo < hi)
+	{
+		u16 mid=(lo+hi)/2;
+		flash_read_page(sector+APP_CNT_BITMAP_OFS+mid, 1, &b);
+		if (b == 0x00)   lo=mid+1;
+		else             hi=mid;
+	}
+	u16 n=lo*8;
+	if (lo < APP_CNT_BITMAP_LEN)
+	{	// bits of a byte are cleared from bit 0
+		flash_read_page(sector+APP_CNT_BITMAP_OFS+lo, 1, &b);
+		while (b && (b&1)==0) { n++; b>>=1; }
+	}
+	*base=hdr.base; *blocks=n;
+	return 1;
+}
+
+static void counter_sector_reset(u32 base)
+{	// new base into the other sector (the active one stays valid until the header is written)
+	u32 sector=(app_counter_sector == flash_sector_app_counter) ? flash_sector_app_counter2 : flash_sector_app_counter;
+	appcounter_hdr_t hdr={APP_CNT_MAGIC, base};
+    DEBUGFMT(APP_FLASH_LOG_EN, "[FLS] Flash counter reset (base %u, sector %X)", base, sector);
+	flash_erase_sector(sector);
+	flash_write_page(sector, sizeof(hdr), (u8 *)&hdr);
+	app_counter_sector=sector; app_counter_base=base; app_counter_blocks=0;
+}
+
+u32 app_flash_counter_init(void)
+{
+	u32 base_a=0, base_b=0; u16 blocks_a=0, blocks_b=0;
+	app_counter_sector=0; app_counter_base=0; app_counter_blocks=0;
+	if (!flash_sector_app_counter)   return 0;
+	u8 valid_a=counter_sector_read(flash_sector_app_counter, &base_a, &blocks_a);
+	u8 valid_b=counter_sector_read(flash_sector_app_counter2, &base_b, &blocks_b);
+	if (!valid_a && !valid_b)
+	{	// new device (a reset never erases the active sector): first header into sector A
+		app_counter_sector=flash_sector_app_counter2;
+		counter_sector_reset(0);
+		return 0;
+	}
+	u32 cnt_a=base_a+(u32)blocks_a*APP_FLASH_COUNTER_BLOCK;
+	u32 cnt_b=base_b+(u32)blocks_b*APP_FLASH_COUNTER_BLOCK;
+	if (valid_b && (!valid_a || cnt_b > cnt_a))
+	{
+		app_counter_sector=flash_sector_app_counter2; app_counter_base=base_b; app_counter_blocks=blocks_b;
+	}
+	else
+	{
+		app_counter_sector=flash_sector_app_counter; app_counter_base=base_a; app_counter_blocks=blocks_a;
+	}
+	u32 cnt=app_counter_base+(u32)app_counter_blocks*APP_FLASH_COUNTER_BLOCK;
+    DEBUGFMT(APP_FLASH_LOG_EN, "[FLS] Flash counter %u (base %u, blocks %u, sector %X)", cnt, app_counter_base, app_counter_blocks, app_counter_sector);
+	return cnt;
+}
+
+u32 app_flash_counter_reserve(u32 cnt)
+{
+	if (!app_counter_sector)   return 0;
+	if (cnt < app_counter_base)   cnt=app_counter_base;
+	u32 blocks=(cnt-app_counter_base)/APP_FLASH_COUNTER_BLOCK+1; // blocks needed
+	if (blocks > APP_CNT_BLOCKS_MAX)
+	{	// bitmap full: start new sector at cnt
+		counter_sector_reset(cnt);
+		blocks=1;
+	}
+	while (app_counter_blocks < blocks)
+	{	// clear next bit (write 1 byte)
+		u16 ofs=app_counter_blocks/8;
+		u8 b=(u8)(0xFF<<((app_counter_blocks%8)+1));
+		flash_write_page(app_counter_sector+APP_CNT_BITMAP_OFS+ofs, 1, &b);
+		app_counter_blocks++;
+	}
+	u32 end=app_counter_base+(u32)app_counter_blocks*APP_FLASH_COUNTER_BLOCK;
+    DEBUGFMT(APP_FLASH_DEBUG_EN, "[FLS] Flash counter reserved up to %u", end);
+	return end;
+}
+
 
 
 
@@ -22,8 +22,13 @@
 
 //
 // notes:
-//  - in current version we use polling the UART fifo
-//    since the protocol is only running at 9600 baud
+//  - the protocol is only running at 9600 baud (about 1 ms per byte)
+//  - MCU_SERIAL_RX_IRQ: the UART RX IRQ feeds a ring buffer (retention),
+//    the receive handler parses from the ring and the CPU is stalled
+//    between bytes (suspend would stop the UART clock)
+//  - MCU_SERIAL_TX_DMA: a complete TX packet is sent by the UART DMA
+//    channel, the CPU is stalled until the DMA TX done IRQ
+//  - else: polling the UART fifo
 //
 
 #if (APP_MCU_SERIAL)  // component enabled
@@ -56,6 +61,44 @@
 #define MCU_TXRX_PACKET_TIMEOUT	160000	// 160 ms
 #endif
 
+// UART RX IRQ (ring buffer)
+#ifndef MCU_SERIAL_RX_IRQ
+#define MCU_SERIAL_RX_IRQ 0
+#endif
+#ifndef MCU_RX_RING_SIZE
+#define MCU_RX_RING_SIZE		64		// power of 2
+#endif
+#ifndef MCU_SERIAL_STALL_TIME
+#define MCU_SERIAL_STALL_TIME	2000	// 2 ms (max. CPU stall waiting for the next byte/TX done)
+#endif
+
+// UART TX DMA
+#ifndef MCU_SERIAL_TX_DMA
+#define MCU_SERIAL_TX_DMA 0
+#endif
+
+// receive packet queue
+#ifndef MCU_RXBUF_CNT
+#define MCU_RXBUF_CNT			1		// packets
+#endif
+
+// adaptive response timeout (response latency statistics per command)
+#ifndef MCU_RESP_TIMEOUT_ADAPTIVE
+#define MCU_RESP_TIMEOUT_ADAPTIVE 0
+#endif
+#ifndef MCU_RESP_LATENCY_SLOTS
+#define MCU_RESP_LATENCY_SLOTS	6		// commands with response latency statistics
+#endif
+#ifndef MCU_RESP_LATENCY_SAMPLES
+#define MCU_RESP_LATENCY_SAMPLES 8		// min. samples for adaptive timeout
+#endif
+#ifndef MCU_RESP_TIMEOUT_FACTOR
+#define MCU_RESP_TIMEOUT_FACTOR	3		// timeout = max. latency * factor + margin
+#endif
+#ifndef MCU_RESP_TIMEOUT_MARGIN
+#define MCU_RESP_TIMEOUT_MARGIN	10000	// 10 ms
+#endif
+
 #ifndef APP_SERIAL_LOG_EN
 #define APP_SERIAL_LOG_EN 0
 #endif
@@ -140,10 +183,13 @@ static void MCU_DEBUG_PACKET(const char *info, u8 tx, const u8 *data, u16 datale
 
 // send/receive buffers
 #define TXBUF_CNT 3
+#define RXBUF_CNT MCU_RXBUF_CNT
 static _attribute_data_retention_ u8 mcu_tx_buf_in = 0;
 static _attribute_data_retention_ u8 mcu_tx_buf_out = 0;
 static _attribute_data_retention_ mcu_buf_t mcu_tx_buf[TXBUF_CNT];
-static _attribute_data_retention_ mcu_buf_t mcu_rx_buf;
+static _attribute_data_retention_ u8 mcu_rx_buf_in = 0;
+static _attribute_data_retention_ u8 mcu_rx_buf_out = 0;
+static _attribute_data_retention_ mcu_buf_t mcu_rx_buf[RXBUF_CNT];
 
 //
 // packet CRC calculation
@@ -183,13 +229,36 @@ static u8 mcu_uart_initialized = 0;
 static u8 mcu_pad_wakeup = 0;
 static u32 mcu_pad_wakeup_time = 0;
 
+#if (MCU_SERIAL_TX_DMA)
+// TX DMA buffer (DMA length word + packet)
+typedef struct
+{
+	u32 dmalen;
+	u8 data[MCU_PACKET_HDRLEN+MCU_PACKET_MAXDATA];
+} mcu_tx_dma_t;
+static _attribute_data_retention_ mcu_tx_dma_t mcu_tx_dma __attribute__((aligned(4)));
+static _attribute_data_retention_ volatile u8 mcu_tx_dma_done = 0;
+#endif
+
 static void mcu_uart_init(void)
 {   // init normal and DeepRetn
 	uart_gpio_set(UART_TX_PIN, UART_RX_PIN);
 	uart_reset(); // reset all UART registers
 	uart_ndma_clear_tx_index(); uart_ndma_clear_rx_index();
 	uart_init_baudrate(UART_BAUDRATE, CLOCK_SYS_CLOCK_HZ, PARITY_NONE, STOP_BIT_ONE);
+	#if (MCU_SERIAL_RX_IRQ)
+	uart_ndma_irq_triglevel(1, 0); // RX IRQ on every byte
+	uart_irq_enable(1, 0); // RX enable, TX disable
+	irq_set_mask(FLD_IRQ_UART_EN);
+	#else
 	uart_irq_enable(0, 0); // disable
+	#endif
+	#if (MCU_SERIAL_TX_DMA)
+	uart_dma_enable(0, 1); // RX no DMA, TX DMA
+	dma_chn_irq_enable(FLD_DMA_CHN_UART_TX, 1);
+	irq_set_mask(FLD_IRQ_DMA_EN);
+	mcu_tx_dma_done = 1;
+	#endif
 	mcu_uart_initialized = 1;
 }
 
@@ -214,6 +283,87 @@ static u8 inline pop_rx_fifo(void)
 	return uart_ndma_read_byte();
 }
 
+#if (MCU_SERIAL_RX_IRQ)
+// RX ring buffer (filled by UART RX IRQ)
+static _attribute_data_retention_ u8 mcu_rx_ring[MCU_RX_RING_SIZE];
+static _attribute_data_retention_ volatile u8 mcu_rx_ring_in = 0;
+static _attribute_data_retention_ volatile u8 mcu_rx_ring_out = 0;
+
+static inline void mcu_rx_reset(void)
+{
+	mcu_rx_ring_in = 0; mcu_rx_ring_out = 0;
+}
+static inline u8 mcu_rx_avail(void)
+{
+	return (mcu_rx_ring_in != mcu_rx_ring_out);
+}
+static inline u8 mcu_rx_pop(void)
+{
+	u8 b=mcu_rx_ring[mcu_rx_ring_out];
+	mcu_rx_ring_out=(mcu_rx_ring_out+1) & (MCU_RX_RING_SIZE-1);
+	return b;
+}
+#else
+static inline void mcu_rx_reset(void)
+{
+}
+static inline u8 mcu_rx_avail(void)
+{
+	return get_rx_fifo_cnt() > 0;
+}
+static inline u8 mcu_rx_pop(void)
+{
+	return pop_rx_fifo();
+}
+#endif
+
+#if (MCU_SERIAL_TX_DMA)
+static void mcu_tx_dma_start(const u8 *data, u16 len)
+{
+	memcpy(mcu_tx_dma.data, data, len);
+	mcu_tx_dma.dmalen = len;
+	mcu_tx_dma_done = 0;
+	uart_dma_send((unsigned char *)&mcu_tx_dma);
+}
+#endif
+
+_attribute_ram_code_ void app_serial_irq_handler(void)
+{
+	#if (MCU_SERIAL_RX_IRQ)
+	if (uart_ndmairq_get())
+	{
+		while (get_rx_fifo_cnt() > 0)
+		{	// reading the data clears the IRQ
+			u8 b=pop_rx_fifo();
+			u8 next=(mcu_rx_ring_in+1) & (MCU_RX_RING_SIZE-1);
+			if (next == mcu_rx_ring_out)   continue; // full: drop byte (packet crc error)
+			mcu_rx_ring[mcu_rx_ring_in]=b; mcu_rx_ring_in=next;
+		}
+	}
+	#endif
+	#if (MCU_SERIAL_TX_DMA)
+	if (reg_dma_irq_status & FLD_DMA_CHN_UART_TX)
+	{
+		reg_dma_irq_status = FLD_DMA_CHN_UART_TX; // clear
+		mcu_tx_dma_done = 1;
+	}
+	#endif
+}
+
+#if (MCU_SERIAL_RX_IRQ || MCU_SERIAL_TX_DMA)
+// CPU stall until the next byte (UART IRQ), TX DMA done, BLE (RF, system timer) or timeout (timer0)
+// IRQs disabled from the rx check to the stall: a byte received in between is a pending IRQ (no stall)
+_attribute_ram_code_ static void mcu_serial_stall(u32 us)
+{
+	u8 r=irq_disable();
+	u32 mask=reg_mcu_wakeup_mask;
+	reg_mcu_wakeup_mask = mask | FLD_IRQ_UART_EN | FLD_IRQ_DMA_EN | FLD_IRQ_ZB_RT_EN | FLD_IRQ_SYSTEM_TIMER;
+	if (!mcu_rx_avail())   cpu_stall_wakeup_by_timer0(us*CLOCK_SYS_CLOCK_1US);
+	reg_mcu_wakeup_mask = mask;
+	irq_restore(r); // handle the wakeup IRQ
+}
+#endif
+
 void mcu_wakeup_init(void)
 {
 	// MCU wakeup (pull down resistor 10K on board or MCU pulldown)
@@ -268,13 +418,15 @@ static u8 rxtx_notify(int evt, u8 stat, const mcu_packet_t *pkt);
 
 static void mcu_init_serial(u8 resetbuf)
 {	// init normal and DeepRetn
+	mcu_rx_reset();
 	mcu_uart_init();
 	mcu_tx_buf_in = 0; mcu_tx_buf_out = 0;
-	mcu_rx_buf.bstate = BSTATE_IDLE;
+	mcu_rx_buf_in = 0; mcu_rx_buf_out = 0;
+	for (u8 u=0; u<RXBUF_CNT; u++)   mcu_rx_buf[u].bstate = BSTATE_IDLE;
 	if (resetbuf)
 	{
 		memset( &mcu_tx_buf[0], 0, TXBUF_CNT*sizeof(mcu_buf_t) );
-		memset( &mcu_rx_buf, 0, sizeof(mcu_buf_t) );
+		memset( &mcu_rx_buf[0], 0, RXBUF_CNT*sizeof(mcu_buf_t) );
 	}
 }
 
@@ -351,6 +503,18 @@ _attribute_optimize_size_ static u8 mcu_handle_send(void)
 			if (delay && !clock_time_exceed(buf->clocktime,delay))    return 1; // busy
 			buf->pstate=PSTATE_DATA; // send delay processed
 		}
+		#if (MCU_SERIAL_TX_DMA)
+		if (buf->pstate == PSTATE_DATA)
+		{
+			if (buf->dataofs == 0)
+			{	// start DMA (whole packet)
+				mcu_tx_dma_start(buf->data, buf->datalen);
+				buf->dataofs = buf->datalen; buf->clocktime=clock_time();
+			}
+			if (!mcu_tx_dma_done && !clock_time_exceed(buf->clocktime,MCU_TXRX_PACKET_TIMEOUT))    return 1; // DMA busy
+			buf->pstate++;
+		}
+		#else
 		while (buf->pstate == PSTATE_DATA)
 		{
 			if (buf->dataofs >= buf->datalen) { buf->pstate++; break; } // all data done
@@ -358,6 +522,7 @@ _attribute_optimize_size_ static u8 mcu_handle_send(void)
 			push_tx_fifo( buf->data[buf->dataofs] );
 			buf->dataofs++;
 		}
+		#endif
 		if (buf->pstate == PSTATE_DONE)
 		{
 			if (get_tx_fifo_cnt()>0)    return 1;  // wait for fifo send
@@ -377,52 +542,168 @@ static inline u8 mcu_tx_busy(void)
 	return (mcu_tx_buf[mcu_tx_buf_out].bstate == BSTATE_IDLE) ? 0 : 1;
 }
 
+// DP list stream parser (DP reports larger than MCU_PACKET_MAXDATA)
+// data: flags, DP list (DP-ID, DP-Type, DataLen_H, DataLen_L, Data)
+// DPs of the device DP table (app_dp_is_mapped) with up to 4 data bytes are stored in the rx buffer,
+// other DPs are skipped (a DP list still too large is an error, not a truncated report)
+#define MCU_DP_HDRLEN	4
+#define MCU_DP_MAXLEN	4
+typedef struct
+{
+	u8 active;
+	u8 crc; // running checksum (header+data)
+	u8 pos; // position in dp[] (header)
+	u8 store; // store DP value
+	u8 overflow; // mapped DP not stored (buffer full)
+	u8 dp[MCU_DP_HDRLEN];
+	u16 dplen, dpofs;
+	u16 skipped; // DPs not stored (not mapped, value size)
+} mcu_dp_stream_t;
+static _attribute_data_retention_ mcu_dp_stream_t mcu_rx_dp;
+
+static u8 packet_is_dplist(const mcu_packet_t *pkt);
+
+_attribute_optimize_size_ static void mcu_dp_stream_start(mcu_buf_t *buf)
+{
+	mcu_dp_stream_t *st=&mcu_rx_dp;
+	st->active=1; st->crc=calc_packet_crc(buf->data, MCU_PACKET_HDRLEN);
+	st->pos=0; st->dplen=0; st->dpofs=0; st->skipped=0; st->overflow=0;
+}
+
+_attribute_optimize_size_ static void mcu_dp_stream_byte(mcu_buf_t *buf, u8 b)
+{
+	mcu_dp_stream_t *st=&mcu_rx_dp;
+	st->crc+=b;
+	if (buf->dataofs == MCU_PACKET_HDRLEN)
+	{	// flags
+		buf->data[buf->dataofs++]=b; return;
+	}
+	if (st->pos < MCU_DP_HDRLEN)
+	{	// DP header
+		st->dp[st->pos++]=b;
+		if (st->pos < MCU_DP_HDRLEN)   return;
+		st->dplen=st->dp[2]; st->dplen<<=8; st->dplen|=st->dp[3]; st->dpofs=0;
+		st->store=(st->dplen <= MCU_DP_MAXLEN && app_dp_is_mapped(st->dp[0], st->dp[1]));
+		if (st->store && buf->dataofs+MCU_DP_HDRLEN+st->dplen >= sizeof(buf->data)) // keep space for crc
+		{
+			st->store=0; st->overflow=1;
+		}
+		if (st->store)
+		{	// store DP header, value follows
+			memcpy(&buf->data[buf->dataofs], st->dp, MCU_DP_HDRLEN);
+			buf->dataofs+=MCU_DP_HDRLEN;
+		}
+		else
+			st->skipped++;
+		if (st->dplen == 0)   st->pos=0;
+		return;
+	}
+	// DP value
+	if (st->store)   buf->data[buf->dataofs++]=b;
+	st->dpofs++;
+	if (st->dpofs >= st->dplen)   st->pos=0; // next DP
+}
+
+_attribute_optimize_size_ static u8 mcu_dp_stream_done(mcu_buf_t *buf, u8 crc)
+{	// rewrite packet with the stored DP list (returns PERROR_xxx)
+	mcu_dp_stream_t *st=&mcu_rx_dp;
+	st->active=0;
+	if (crc != st->crc)   return PERROR_CRC;
+	if (st->overflow)
+	{
+		DEBUGFMT(APP_SERIAL_LOG_EN, "[MCU] DP stream: DP list too large (%u DPs skipped)", st->skipped);
+		return PERROR_SIZE;
+	}
+	mcu_packet_t *pkt=buf_data_packet(buf);
+	u16 datalen=buf->dataofs-MCU_PACKET_HDRLEN;
+	pkt->datalen_h=datalen>>8; pkt->datalen_l=datalen&0xFF;
+	add_packet_crc(pkt);
+	buf->datalen=MCU_PACKET_HDRLEN+datalen+1; buf->dataofs=buf->datalen;
+	if (st->skipped)   DEBUGFMT(APP_SERIAL_LOG_EN, "[MCU] DP stream: %u DPs skipped", st->skipped);
+	return PERROR_NONE;
+}
+
 _attribute_optimize_size_ static u8 mcu_handle_receive(u8 irq)
 {
-	mcu_buf_t *buf=&mcu_rx_buf; // only one rx buffer
-	// Check for MCU notifications in idle state
-	if (buf->bstate == BSTATE_IDLE)
-    {
-		if (get_rx_fifo_cnt()==0)    return 0;  // nothing to receive
-		// start receive packet
-		buf->datalen = 0; buf->dataofs = 0;
-		buf->clocktime = clock_time();
-		buf->pstate = PSTATE_DATA; buf->perror = PERROR_NONE;
-		buf->bstate = BSTATE_PROCESS;
-    }
-	while (buf->bstate == BSTATE_PROCESS && buf->pstate == PSTATE_DATA)
+	u8 busy=0;
+	// receive packets into the rx queue
+	mcu_buf_t *buf=&mcu_rx_buf[mcu_rx_buf_in];
+	while (1)
 	{
-		if (get_rx_fifo_cnt() == 0)
+		// Check for MCU notifications in idle state
+		if (buf->bstate == BSTATE_IDLE)
 		{
-			if (!clock_time_exceed(buf->clocktime,MCU_TXRX_PACKET_TIMEOUT))    return 1; // wait for next byte
-			buf->bstate = BSTATE_ERROR; buf->perror = PERROR_TIMEOUT;
-			break;
+			if (!mcu_rx_avail())    break;  // nothing to receive
+			// start receive packet
+			buf->datalen = 0; buf->dataofs = 0;
+			buf->clocktime = clock_time();
+			buf->pstate = PSTATE_DATA; buf->perror = PERROR_NONE;
+			buf->bstate = BSTATE_PROCESS;
+			mcu_rx_dp.active = 0;
 		}
-		u8 b=pop_rx_fifo();
-		if (buf->dataofs < sizeof(buf->data))
-			buf->data[buf->dataofs++]=b;
-		buf->datalen++; buf->clocktime=clock_time();
-		// pre check packet data
-		mcu_packet_t *pkt=buf_data_packet(buf);
-		if ((buf->datalen==1 && pkt->header1!=0x55) ||
-			(buf->datalen==2 && pkt->header2!=0xAA))
+		if (buf->bstate != BSTATE_PROCESS || buf->pstate != PSTATE_DATA)
+			break; // rx queue full (wait for processing)
+		if (!mcu_rx_avail())
 		{
-			buf->datalen = 0; buf->dataofs = 0; // restart rx
+			if (!clock_time_exceed(buf->clocktime,MCU_TXRX_PACKET_TIMEOUT)) { busy=1; break; } // wait for next byte
+			buf->bstate = BSTATE_ERROR; buf->perror = PERROR_TIMEOUT;
 		}
-		if (buf->datalen > MCU_PACKET_HDRLEN)
+		else
 		{
-			u16 pktdatalen=packet_datalen(pkt);
-			if (pktdatalen > 500)
+			u8 b=mcu_rx_pop();
+			mcu_packet_t *pkt=buf_data_packet(buf);
+			u16 pktdatalen=(buf->datalen >= MCU_PACKET_HDRLEN) ? packet_datalen(pkt) : 0;
+			if (mcu_rx_dp.active)
+			{	// large DP report (crc checked when done)
+				if (buf->datalen < MCU_PACKET_HDRLEN+pktdatalen)   mcu_dp_stream_byte(buf, b);
+			}
+			else if (buf->dataofs < sizeof(buf->data))
+				buf->data[buf->dataofs++]=b;
+			buf->datalen++; buf->clocktime=clock_time();
+			// pre check packet data
+			if ((buf->datalen==1 && pkt->header1!=0x55) ||
+				(buf->datalen==2 && pkt->header2!=0xAA))
 			{
-				buf->bstate = BSTATE_ERROR; buf->perror = PERROR_FORMAT;
+				buf->datalen = 0; buf->dataofs = 0; // restart rx
 			}
-			else if (buf->datalen==MCU_PACKET_HDRLEN+pktdatalen+1)
-				buf->pstate = PSTATE_DONE; // header+data+crc done
+			if (buf->datalen == MCU_PACKET_HDRLEN)
+			{	// header done
+				pktdatalen=packet_datalen(pkt);
+				if (pktdatalen > MCU_PACKET_MAXDATA && packet_is_dplist(pkt))
+					mcu_dp_stream_start(buf);
+			}
+			if (buf->datalen > MCU_PACKET_HDRLEN)
+			{
+				if (pktdatalen > 500)
+				{
+					buf->bstate = BSTATE_ERROR; buf->perror = PERROR_FORMAT;
+				}
+				else if (buf->datalen==MCU_PACKET_HDRLEN+pktdatalen+1)
+				{
+					buf->pstate = PSTATE_DONE; // header+data+crc done
+					if (mcu_rx_dp.active)
+					{
+						u8 perror=mcu_dp_stream_done(buf, b);
+						if (perror != PERROR_NONE) { buf->bstate = BSTATE_ERROR; buf->perror = perror; }
+					}
+				}
+			}
+		}
+		if (buf->bstate != BSTATE_PROCESS || buf->pstate != PSTATE_DATA)
+		{	// packet done or error: next rx buffer
+			mcu_rx_buf_in++; if (mcu_rx_buf_in>=RXBUF_CNT)   mcu_rx_buf_in=0;
+			buf=&mcu_rx_buf[mcu_rx_buf_in];
 		}
 	}
-	if (buf->bstate == BSTATE_PROCESS && buf->pstate == PSTATE_DONE && !irq)
+	if (irq)   return busy;
+	// process received packets in order (one per loop)
+	buf=&mcu_rx_buf[mcu_rx_buf_out];
+	if (buf->bstate == BSTATE_IDLE || (buf->bstate == BSTATE_PROCESS && buf->pstate == PSTATE_DATA))
+		return busy; // nothing received
+	u8 ret=0;
+	if (buf->bstate == BSTATE_PROCESS && buf->pstate == PSTATE_DONE)
 	{
-		u8 ret=0; mcu_packet_t *pkt=buf_data_packet(buf);
+		mcu_packet_t *pkt=buf_data_packet(buf);
 		if (buf->datalen > MCU_PACKET_HDRLEN+MCU_PACKET_MAXDATA)
 		{
 			buf->bstate = BSTATE_ERROR; buf->perror = PERROR_SIZE;
@@ -438,24 +719,56 @@ _attribute_optimize_size_ static u8 mcu_handle_receive(u8 irq)
 	    	ret=rxtx_notify(RXTX_EVT_RECV, 0, pkt);
 			buf->bstate = BSTATE_IDLE; buf->pstate = PSTATE_NONE;
 	    }
-		return ret;
 	}
-	if (buf->bstate == BSTATE_ERROR && !irq)
+	if (buf->bstate == BSTATE_ERROR)
 	{
 		u8 perror=buf->perror;
 		#if (APP_SERIAL_LOG_EN)
 		DEBUGFMT(APP_SERIAL_LOG_EN, "[MCU] Receive error: %s", perror_txt[perror] );
 		#endif
 		buf->bstate = BSTATE_IDLE;
-		return rxtx_notify(RXTX_EVT_RECV, perror, 0);
+		ret=rxtx_notify(RXTX_EVT_RECV, perror, 0);
 	}
-	return 0;
+	mcu_rx_buf_out++; if (mcu_rx_buf_out>=RXBUF_CNT)   mcu_rx_buf_out=0;
+	if (mcu_rx_buf[mcu_rx_buf_out].bstate != BSTATE_IDLE)   busy=1; // more packets queued
+	return ret | busy;
 }
 
 static inline u8 mcu_rx_busy(void)
 {
-	return (mcu_rx_buf.bstate == BSTATE_IDLE) ? 0 : 1;
+	for (u8 u=0; u<RXBUF_CNT; u++)
+		if (mcu_rx_buf[u].bstate != BSTATE_IDLE)   return 1;
+	return 0;
+}
+
+#if (MCU_SERIAL_RX_IRQ || MCU_SERIAL_TX_DMA)
+static u8 mcu_serial_stall_check(void)
+{	// only waiting for UART data (IRQ or DMA driven)
+	u8 wait=0;
+	if (mcu_rx_busy())
+	{
+		#if (MCU_SERIAL_RX_IRQ)
+		const mcu_buf_t *buf=&mcu_rx_buf[mcu_rx_buf_in];
+		if (mcu_rx_buf_out != mcu_rx_buf_in)   return 0; // received packets to process
+		if (buf->bstate != BSTATE_PROCESS || buf->pstate != PSTATE_DATA)   return 0;
+		wait=1;
+		#else
+		return 0; // polling rx fifo
+		#endif
+	}
+	if (mcu_tx_busy())
+	{
+		#if (MCU_SERIAL_TX_DMA)
+		const mcu_buf_t *buf=&mcu_tx_buf[mcu_tx_buf_out];
+		if (buf->bstate != BSTATE_PROCESS || buf->pstate < PSTATE_DATA)   return 0;
+		wait=1;
+		#else
+		return 0; // polling tx fifo
+		#endif
+	}
+	return wait;
 }
+#endif
 
 
 //
@@ -651,6 +964,63 @@ static _attribute_data_retention_ u8 current_cmd_seq_stat = CMD_SEQ_STAT_none;
 static _attribute_data_retention_ u8 current_cmd_seq_retry = 0;
 static _attribute_data_retention_ u32 current_cmd_seq_time = 0;
 
+#if (MCU_RESP_TIMEOUT_ADAPTIVE)
+// response latency statistics per command (first send only, 0.1 ms units)
+typedef struct
+{
+	u8 cmd;
+	u8 cnt;
+	u16 max;
+} mcu_resp_latency_t;
+static _attribute_data_retention_ mcu_resp_latency_t mcu_resp_latency[MCU_RESP_LATENCY_SLOTS];
+
+static mcu_resp_latency_t *mcu_resp_latency_get(u8 cmd, u8 add)
+{
+	mcu_resp_latency_t *lat=&mcu_resp_latency[0];
+	for (u8 u=0; u<MCU_RESP_LATENCY_SLOTS; u++, lat++)
+	{
+		if (lat->cnt && lat->cmd == cmd)   return lat;
+		if (!lat->cnt && add)
+		{
+			lat->cmd=cmd; lat->max=0;
+			return lat;
+		}
+	}
+	return 0;
+}
+
+static void mcu_resp_latency_add(u8 cmd, u32 us)
+{
+	mcu_resp_latency_t *lat=mcu_resp_latency_get(cmd, 1);
+	if (!lat)   return; // no free slot
+	u16 t=(us>=0xFFFF*100) ? 0xFFFF : us/100;
+	if (t > lat->max)   lat->max=t;
+	if (lat->cnt < 0xFF)   lat->cnt++;
+	DEBUGFMT(APP_SERIAL_LOG_EN, "[MCU] CmdSeq %02X resp %u us (max %u, 0.1 ms)", cmd, us, lat->max);
+}
+
+// response timeout: the max. latency was too low (late response or MCU load)
+static void mcu_resp_latency_timeout(u8 cmd)
+{
+	mcu_resp_latency_t *lat=mcu_resp_latency_get(cmd, 0);
+	if (!lat || lat->cnt < MCU_RESP_LATENCY_SAMPLES)   return; // timeout not adaptive
+	lat->max=(lat->max < 0x8000) ? lat->max*2 : 0xFFFF;
+}
+
+static u32 mcu_resp_timeout(u8 cmd, u8 retry)
+{
+	const mcu_resp_latency_t *lat=mcu_resp_latency_get(cmd, 0);
+	if (!lat || lat->cnt < MCU_RESP_LATENCY_SAMPLES)   return MCU_TXRX_PACKET_TIMEOUT; // not enough samples
+	if (retry >= 2)   return MCU_TXRX_PACKET_TIMEOUT; // last retry
+	u32 timeout=((u32)lat->max*100*MCU_RESP_TIMEOUT_FACTOR + MCU_RESP_TIMEOUT_MARGIN) << retry;
+	return (timeout < MCU_TXRX_PACKET_TIMEOUT) ? timeout : MCU_TXRX_PACKET_TIMEOUT;
+}
+#else
+#define mcu_resp_latency_add(cmd, us) ((void)0)
+#define mcu_resp_latency_timeout(cmd) ((void)0)
+#define mcu_resp_timeout(cmd, retry) MCU_TXRX_PACKET_TIMEOUT
+#endif
+
 static u8 mcu_cmd_seq_init(const struct _mcu_cmd_seq_t *seq)
 {
 	if (current_cmd_seq != 0)   return 1;
@@ -696,7 +1066,8 @@ _attribute_optimize_size_ static u8 mcu_cmd_seq_loop(void)
 	if (current_cmd_seq_stat==CMD_SEQ_STAT_waitresp)
 	{
 		if (current_cmd_seq->resp==CMD_None)  { current_cmd_seq_stat++; return 1; } // no response expected
-		if (!clock_time_exceed(current_cmd_seq_time,MCU_TXRX_PACKET_TIMEOUT))    return 1; // busy
+		if (!clock_time_exceed(current_cmd_seq_time,mcu_resp_timeout(current_cmd_seq->cmd, current_cmd_seq_retry)))    return 1; // busy
+		mcu_resp_latency_timeout(current_cmd_seq->cmd);
 		current_cmd_seq_retry++; if (current_cmd_seq_retry>2)   return mcu_cmd_seq_error();
         DEBUGFMT(APP_SERIAL_LOG_EN, "[MCU] CmdSeq retry %u (response timeout)", current_cmd_seq_retry);
         current_cmd_seq_stat=CMD_SEQ_STAT_send;
@@ -736,6 +1107,8 @@ _attribute_optimize_size_ static u8 mcu_cmd_seq_rx_notify(const mcu_packet_t *pk
 			if (len > current_cmd_seq->respdatalen)   len=current_cmd_seq->respdatalen;
 			memcpy( current_cmd_seq->respdata, pkt->data, len);
 		}
+		if (current_cmd_seq_retry == 0) // a late response to a retry is timed from the retry
+			mcu_resp_latency_add(current_cmd_seq->cmd, (clock_time()-current_cmd_seq_time)/CLOCK_16M_SYS_TIMER_CLK_1US);
 		current_cmd_seq_stat++;
 	}
 	return (current_cmd_seq?1:0); // busy
@@ -745,6 +1118,11 @@ _attribute_optimize_size_ static u8 mcu_cmd_seq_rx_notify(const mcu_packet_t *pk
 // RX/TX notifications
 //
 
+static u8 packet_is_dplist(const mcu_packet_t *pkt)
+{
+	return (pkt->command==CMD_ReportData || pkt->command==CMD_ReportStatus);
+}
+
 _attribute_optimize_size_ static u8 tx_notify(const mcu_packet_t *pkt)
 {
 	if (!pkt)   return 0;
@@ -759,6 +1137,7 @@ _attribute_optimize_size_ static u8 rx_notify(const mcu_packet_t *pkt)
 	// app data notify
 	u8 notify=0;
 	if (pkt->command==CMD_GetMCUInformation)	notify=APP_NOTIFY_PRODUCTID;
+	else if (pkt->command==CMD_QueryMCUVersion)	notify=APP_NOTIFY_MCUVERSION;
 	else if (pkt->command==CMD_ReportData)		notify=APP_NOTIFY_DPDATA;
 	else if (pkt->command==CMD_ReportStatus)	notify=APP_NOTIFY_DPDATA;
 	else if (pkt->command==CMD_ResetModule)		notify=APP_NOTIFY_FACTORYRESET;
@@ -901,6 +1280,10 @@ _attribute_optimize_size_ u8 app_serial_loop(void)
 	busy |= mcu_handle_receive(0);
 	busy |= mcu_cmd_seq_loop();
 	busy |= module_wakeup_status();
+	#if (MCU_SERIAL_RX_IRQ || MCU_SERIAL_TX_DMA)
+	if (busy && mcu_serial_stall_check())
+		mcu_serial_stall(MCU_SERIAL_STALL_TIME); // packet in progress: idle until the next byte/TX done
+	#endif
 	// debug status
     #if (APP_SERIAL_DEBUG_EN)
 	static _attribute_data_retention_ u8 wakeup_last=0xFF;
@@ -34,6 +34,7 @@
 // #if USE_SECURITY_BEACON
 #include "ccm.h"
 #include "drivers/8258/aes.h"
+#include "drivers.h" // aes registers
 // #include "stack/ble/crypt/aes/aes_att.h"
 
 /*
@@ -201,6 +202,144 @@ int ccm_auth_crypt( int mode, const unsigned char *key,
 	return (0);
 }
 
+/*
+ * Fixed shape encryption: nonce 13 bytes (q = 2), no additional data,
+ * tag 4 bytes, length <= CCM_FAST_MAXLEN (max. 2 blocks).
+ * The key is loaded into the AES engine once, then only the blocks are fed
+ * (aes_encrypt() loads the key for each block).
+ */
+#define CCM_FAST_FLAGS_B0	((((4 - 2) / 2) << 3) | (2 - 1)) // tag_len 4, q 2
+#define CCM_FAST_FLAGS_CTR	(2 - 1)
+
+_attribute_ram_code_ static void ccm_aes_setkey(const unsigned char *key)
+{
+    unsigned char i;
+    reg_aes_ctrl &= (~FLD_AES_CTRL_CODEC_TRIG); // encrypt
+    for (i = 0; i < 16; i++)
+        reg_aes_key(i) = key[i];
+}
+
+_attribute_ram_code_ static void ccm_aes_block(const unsigned char *in, unsigned char *out)
+{
+    unsigned char i;
+    unsigned int w;
+    while ((reg_aes_ctrl & FLD_AES_CTRL_DATA_FEED) == 0);
+    for (i = 0; i < 16; i += 4)
+        reg_aes_data = in[i] | (in[i + 1] << 8) | (in[i + 2] << 16) | ((unsigned int) in[i + 3] << 24);
+    while ((reg_aes_ctrl & FLD_AES_CTRL_CODEC_FINISHED) == 0);
+    for (i = 0; i < 16; i += 4) {
+        w = reg_aes_data;
+        out[i] = (unsigned char) w;
+        out[i + 1] = (unsigned char) (w >> 8);
+        out[i + 2] = (unsigned char) (w >> 16);
+        out[i + 3] = (unsigned char) (w >> 24);
+    }
+}
+
+_attribute_ram_code_ int ccm_encrypt_and_tag_fast( const unsigned char *key,
+                         const unsigned char *iv,
+                         const unsigned char *input, unsigned char length,
+                         unsigned char *output, unsigned char *tag )
+{
+    unsigned char i, n, use_len;
+    unsigned char b[16];
+    unsigned char y[16];
+    unsigned char ctr[16];
+    if (length > CCM_FAST_MAXLEN)
+        return (-1);
+    ccm_aes_setkey(key);
+    /* B_0 and A_0 share the nonce */
+    b[0] = CCM_FAST_FLAGS_B0;
+    ctr[0] = CCM_FAST_FLAGS_CTR;
+    for (i = 0; i < 13; i++) {
+        b[1 + i] = iv[i];
+        ctr[1 + i] = iv[i];
+    }
+    b[14] = 0;
+    b[15] = length;
+    ctr[14] = 0;
+    /* Start CBC-MAC with first block */
+    ccm_aes_block(b, y);
+    /* CBC-MAC and CTR per block (zero padding: no xor) */
+    for (n = 0, ctr[15] = 1; n < length; n += 16, ctr[15]++) {
+        use_len = (length - n > 16) ? 16 : length - n;
+        for (i = 0; i < use_len; i++)
+            y[i] ^= input[n + i];
+        ccm_aes_block(y, y);
+        ccm_aes_block(ctr, b);
+        for (i = 0; i < use_len; i++)
+            output[n + i] = input[n + i] ^ b[i];
+    }
+    /* Tag: mask with S_0 */
+    ctr[15] = 0;
+    ccm_aes_block(ctr, b);
+    for (i = 0; i < 4; i++)
+        tag[i] = y[i] ^ b[i];
+    return (0);
+}
+
+/*
+ * Keystream for the fixed shape: tag mask S_0 (4 bytes), S_1 .. S_n.
+ * Depends only on key and nonce, not on the data.
+ */
+_attribute_ram_code_ int ccm_keystream_fast( const unsigned char *key,
+                         const unsigned char *iv, unsigned char length,
+                         unsigned char *ks )
+{
+    unsigned char i, n;
+    unsigned char b[16];
+    unsigned char ctr[16];
+    if (length > CCM_FAST_MAXLEN)
+        return (-1);
+    ccm_aes_setkey(key);
+    ctr[0] = CCM_FAST_FLAGS_CTR;
+    for (i = 0; i < 13; i++)
+        ctr[1 + i] = iv[i];
+    ctr[14] = 0;
+    ctr[15] = 0;
+    ccm_aes_block(ctr, b);
+    for (i = 0; i < 4; i++)
+        ks[i] = b[i];
+    for (n = 0; n < length; n += 16) {
+        ctr[15]++;
+        ccm_aes_block(ctr, ks + 4 + n);
+    }
+    return (0);
+}
+
+/*
+ * Fixed shape encryption with precomputed keystream: CBC-MAC + xor
+ */
+_attribute_ram_code_ int ccm_encrypt_and_tag_ks( const unsigned char *key,
+                         const unsigned char *iv, const unsigned char *ks,
+                         const unsigned char *input, unsigned char length,
+                         unsigned char *output, unsigned char *tag )
+{
+    unsigned char i, n, use_len;
+    unsigned char b[16];
+    unsigned char y[16];
+    if (length > CCM_FAST_MAXLEN)
+        return (-1);
+    ccm_aes_setkey(key);
+    b[0] = CCM_FAST_FLAGS_B0;
+    for (i = 0; i < 13; i++)
+        b[1 + i] = iv[i];
+    b[14] = 0;
+    b[15] = length;
+    ccm_aes_block(b, y);
+    for (n = 0; n < length; n += 16) {
+        use_len = (length - n > 16) ? 16 : length - n;
+        for (i = 0; i < use_len; i++)
+            y[i] ^= input[n + i];
+        ccm_aes_block(y, y);
+        for (i = 0; i < use_len; i++)
+            output[n + i] = input[n + i] ^ ks[4 + n + i];
+    }
+    for (i = 0; i < 4; i++)
+        tag[i] = y[i] ^ ks[i];
+    return (0);
+}
+
 /*
  * Authenticated encryption
  *
@@ -98,6 +98,62 @@ int aes_ccm_auth_decrypt( const unsigned char *key,
                       unsigned char *output,
                       const unsigned char *tag, size_t tag_len );
 
+/**
+ * \brief           CCM encryption, fixed shape fast path (BTHome V2)
+ *
+ * \param key       key must be 16 bytes
+ * \param iv        nonce, must be 13 bytes
+ * \param input     buffer holding the input data (no additional data)
+ * \param length    length of the input data, max. CCM_FAST_MAXLEN
+ * \param output    buffer for holding the output data (may be input)
+ * \param tag       buffer for holding the 4 byte tag
+ *
+ * \note            Same result as aes_ccm_encrypt_and_tag() with
+ *                  iv_len 13, add_len 0 and tag_len 4. The key is loaded
+ *                  into the AES engine once, RAM code (adv prepare callback).
+ *                  Only the BTHome shape (13 byte nonce, no additional data):
+ *                  MiBeacon V5 needs add data, use aes_ccm_encrypt_and_tag().
+ *                  Checked against the generic CCM: tools/ccm_fast.py
+ *
+ * \return          0 if successful, -1 length error
+ */
+#define CCM_FAST_MAXLEN 32
+int ccm_encrypt_and_tag_fast( const unsigned char *key,
+                         const unsigned char *iv,
+                         const unsigned char *input, unsigned char length,
+                         unsigned char *output, unsigned char *tag );
+
+/**
+ * \brief           CCM keystream for the fast path (precomputed, e.g. in idle time)
+ *
+ * \param key       key must be 16 bytes
+ * \param iv        nonce, must be 13 bytes
+ * \param length    length of the data to encrypt later, max. CCM_FAST_MAXLEN
+ * \param ks        buffer for the keystream, CCM_FAST_KS_LEN bytes:
+ *                  tag mask (S_0, 4 bytes), S_1, S_2 (full blocks)
+ *
+ * \return          0 if successful, -1 length error
+ */
+#define CCM_FAST_KS_LEN (4 + CCM_FAST_MAXLEN)
+int ccm_keystream_fast( const unsigned char *key,
+                         const unsigned char *iv, unsigned char length,
+                         unsigned char *ks );
+
+/**
+ * \brief           CCM encryption with a precomputed keystream
+ *
+ * \note            Same result as ccm_encrypt_and_tag_fast(), but only the
+ *                  CBC-MAC needs the AES engine (half the AES operations).
+ *                  ks must be computed by ccm_keystream_fast() with the same
+ *                  key and nonce and a length >= length.
+ *
+ * \return          0 if successful, -1 length error
+ */
+int ccm_encrypt_and_tag_ks( const unsigned char *key,
+                         const unsigned char *iv, const unsigned char *ks,
+                         const unsigned char *input, unsigned char length,
+                         unsigned char *output, unsigned char *tag );
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,6 +34,10 @@
 // IRQ handler
 _attribute_ram_code_ void irq_handler(void)
 {
+	// UART RX (MCU serial)
+	#if (APP_MCU_SERIAL)
+	app_serial_irq_handler();
+	#endif
 	// SDK IRQ handler
 	irq_blt_sdk_handler();
 }
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""
+Advertising density simulator
+
+Models N SGS01 devices advertising sensor data with the same interval
+and reports the packet loss by collisions at one gateway, for growing
+device counts. Compares the timing policies:
+  sync    all devices start at the same time (battery swap), only the
+          BLE advDelay (0..10 ms) per event
+  spread  MAC-seeded phase offset + bounded jitter per event
+          (SENSORDATA_ADV_SPREAD / SENSORDATA_ADV_JITTER_PCT)
+
+A packet is lost, if another packet on the same channel overlaps it.
+The gateway scans the channels 37/38/39 in turn (scan window = scan
+interval) or all channels at once (--multiradio).
+
+Usage:
+  python3 adv_density.py [--interval 8] [--pdu 24] [--devices 10,50,100,150,300]
+                         [--jitter 10] [--duration 600] [--start-spread 2]
+"""
+
+import argparse
+import random
+
+T_BYTE_US = 8           # 1M PHY
+T_CHANNEL_GAP_US = 400  # channel switch + gap between the channels of an adv event (TLSR825x)
+ADV_DELAY_US = 10000    # BLE advDelay 0..10 ms (link layer)
+
+
+def pdu_time_us(payload_len):
+    return (1 + 4 + 2 + 6 + payload_len + 3) * T_BYTE_US
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h or 1
+
+
+def xorshift32(x):
+    x ^= (x << 13) & 0xFFFFFFFF
+    x ^= x >> 17
+    x ^= (x << 5) & 0xFFFFFFFF
+    return x & 0xFFFFFFFF
+
+
+def adv_events(dev, policy, interval_us, duration_us, jitter_pct, start_us, rnd):
+    """adv event start times of one device"""
+    mac = [rnd.randrange(256) for _ in range(6)]
+    state = fnv1a(mac)
+    t = start_us
+    events = []
+    phase = 0
+    if policy == "spread":
+        state = xorshift32(state)
+        phase = max(20000, state % interval_us)
+    first = True
+    while t < duration_us:
+        events.append(t)
+        if policy == "spread":
+            if first:
+                step = phase
+                first = False
+            else:
+                jitter = interval_us * jitter_pct // 100
+                state = xorshift32(state)
+                step = interval_us + (state % (jitter + 1) if jitter else 0)
+        else:
+            step = interval_us
+        t += step + rnd.randrange(ADV_DELAY_US + 1)
+    return events
+
+
+def simulate(n, policy, args, seed):
+    rnd = random.Random(seed)
+    interval_us = int(args.interval * 1000000)
+    duration_us = int(args.duration * 1000000)
+    t_pdu = pdu_time_us(args.pdu)
+    scan_us = int(args.scan * 1000)
+    packets = {37: [], 38: [], 39: []}
+    for dev in range(n):
+        start = rnd.randrange(int(args.start_spread * 1000000) + 1)
+        for ev in adv_events(dev, policy, interval_us, duration_us, args.jitter, start, rnd):
+            for i, ch in enumerate((37, 38, 39)):
+                t0 = ev + i * (t_pdu + T_CHANNEL_GAP_US)
+                packets[ch].append((t0, t0 + t_pdu, dev, ev))
+    # collisions per channel
+    lost = set()
+    for ch, pk in packets.items():
+        pk.sort()
+        end_max = -1
+        idx_max = None
+        for j, (t0, t1, dev, ev) in enumerate(pk):
+            if t0 < end_max:
+                lost.add((ch, j))
+                lost.add((ch, idx_max))
+            if t1 > end_max:
+                end_max = t1
+                idx_max = j
+    # gateway reception: event received, if one of its packets is heard and not lost
+    events_total = 0
+    events_rx = set()
+    for ch, pk in packets.items():
+        for j, (t0, t1, dev, ev) in enumerate(pk):
+            if ch == 37:
+                events_total += 1
+            if (ch, j) in lost:
+                continue
+            if not args.multiradio:
+                scan_ch = 37 + (t0 // scan_us) % 3
+                if scan_ch != ch or (t1 // scan_us) != (t0 // scan_us):
+                    continue
+            events_rx.add((dev, ev))
+    pk_total = sum(len(pk) for pk in packets.values())
+    return len(lost) / pk_total if pk_total else 0.0, 1.0 - len(events_rx) / events_total if events_total else 0.0
+
+
+def main():
+    ap = argparse.ArgumentParser(description="SGS01 advertising density simulator")
+    ap.add_argument("--interval", type=float, default=8.0, help="adv interval (sec)")
+    ap.add_argument("--pdu", type=int, default=24, help="adv payload length (bytes)")
+    ap.add_argument("--devices", default="10,50,100,150,300,500", help="device counts (list)")
+    ap.add_argument("--jitter", type=int, default=10, help="spread: max. jitter (%% of interval)")
+    ap.add_argument("--duration", type=float, default=600.0, help="simulated time (sec)")
+    ap.add_argument("--start-spread", type=float, default=2.0, help="boot time spread of the devices (sec)")
+    ap.add_argument("--scan", type=float, default=100.0, help="gateway scan window per channel (ms)")
+    ap.add_argument("--multiradio", action="store_true", help="gateway scans all channels at once")
+    ap.add_argument("--runs", type=int, default=3, help="runs per point (averaged)")
+    args = ap.parse_args()
+
+    print("interval %.1f s, payload %u bytes, jitter %u %%, %s" % (
+        args.interval, args.pdu, args.jitter,
+        "multi radio gateway" if args.multiradio else "scan %.0f ms per channel" % args.scan))
+    print("%8s  %22s  %22s" % ("", "sync", "spread"))
+    print("%8s  %10s %11s  %10s %11s" % ("devices", "pkt coll", "event loss", "pkt coll", "event loss"))
+    for n in [int(x) for x in args.devices.split(",")]:
+        res = {}
+        for policy in ("sync", "spread"):
+            c = l = 0.0
+            for r in range(args.runs):
+                cr, lr = simulate(n, policy, args, seed=r * 7919 + n)
+                c += cr
+                l += lr
+            res[policy] = (c / args.runs, l / args.runs)
+        print("%8u  %9.2f%% %10.2f%%  %9.2f%% %10.2f%%" % (
+            n, res["sync"][0] * 100, res["sync"][1] * 100, res["spread"][0] * 100, res["spread"][1] * 100))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+"""
+Sensor data advertising frames: firmware output against receiver rules
+
+Runs the real sensor data builders of the SGS01 firmware (app_ble.c,
+compiled on the host by fw_host.py) for the data formats and options, and
+checks the frames with an independent parser that follows the receiver
+rules:
+  - AD structures: length bytes cover the payload exactly, max. 31 bytes,
+    adv flags required if connectable (optional non-connectable, minimal
+    airtime option DATAFORMAT_OPT_MINIMAL)
+  - BTHome V2 (0xFCD2): info byte (version 2, reserved bits 0), encrypted
+    data + counter (4) + mic (4), objects with known ids and sizes in
+    ascending id order, decoded values equal to the sensor values
+  - BTHome V1 (0x181C): type|length byte (length: id + value), id, value
+  - MiBeacon (0xFE95): frame control, objects id (2) size (1) value, V5
+    encryption (mibeacon_v5.py)
+  - device info packet: packet id, MCU version text, firmware version
+    (app_config.h)
+  - mixed format: BTHome V2 and MiBeacon frame with the same packet id
+    and counter
+The adv PDU length (header + AdvA + payload) and 1M PHY airtime are
+reported for each frame.
+
+Usage:
+  python3 adv_frames.py               print the frames
+  python3 adv_frames.py --check       check the receiver rules
+  python3 adv_frames.py --check --cc clang
+"""
+
+import argparse
+import itertools
+
+from fw_host import build_frames, firmware_version
+from mibeacon_v5 import ccm, decrypt_frame
+
+ADV_PAYLOAD_MAX = 31
+BTHOME_CRYPT_OVERHEAD = 8  # counter + mic
+ADV_FLAGS = b"\x02\x01\x05"
+MINIMAL_SLOW = ("volt",)  # DATA_FLAGS_SLOW
+XIAOMI_ENCRYPT_CONN_BATTERY = 0  # app_config.h
+XIAOMI_FLAGS_DROP = "moist" if XIAOMI_ENCRYPT_CONN_BATTERY else "bat"  # encrypted with adv flags: no room
+
+KEY = bytes.fromhex("231d39c1d7cc1ab1aee224cd096db932")
+MAC = "54:48:E6:8F:80:A5"
+MCU_VERSION = (1, 0, 12, 1, 0, 0)  # MCU soft, hard
+
+OBJ_NAMES = ("pid", "bat", "temp", "volt", "moist")  # fw_host.py request order
+# name, MiBeacon id, divider
+OBJ_XIAOMI = [("temp", 0x1004, 10), ("moist", 0x1008, 100), ("bat", 0x100A, 1)]
+
+# receiver: BTHome V2 object sizes (None: length byte follows)
+BTHOME_SIZES = {0x00: 1, 0x01: 1, 0x02: 2, 0x03: 2, 0x0C: 2, 0x14: 2, 0x15: 1, 0x26: 1,
+                0x53: None, 0xF0: 2, 0xF1: 4, 0xF2: 3}
+BTHOME_NAMES = {0x00: "pid", 0x01: "bat", 0x02: "temp", 0x0C: "volt", 0x14: "moist", 0x53: "text", 0xF2: "fw"}
+
+VALUES = [
+    {"pid": 7, "bat": 100, "temp": 2150, "volt": 3012, "moist": 4500},
+    {"pid": 255, "bat": 0, "temp": -1234, "volt": 65535, "moist": 10000},
+    {"pid": 1, "temp": 5},  # partial: not all objects measured
+]
+
+
+def trunc_div(v, d):
+    return int(v / d)  # C integer division
+
+
+def bthome_nonce(cnt, info):
+    return bytes.fromhex(MAC.replace(":", "")) + b"\xd2\xfc" + bytes([info]) + cnt.to_bytes(4, "little")
+
+
+def objects_mask(values, key, minimal, slow_due):
+    """objects in the frame: minimal airtime without packet id if encrypted, slow objects only if due"""
+    names = [n for n in values]
+    if minimal:
+        if key:
+            names = [n for n in names if n != "pid"]
+        if not slow_due:
+            names = [n for n in names if n not in MINIMAL_SLOW]
+    return names
+
+
+#
+# receiver side
+#
+
+def parse_ad(payload, connectable, err):
+    if len(payload) > ADV_PAYLOAD_MAX:
+        err.append("payload %u > %u bytes" % (len(payload), ADV_PAYLOAD_MAX))
+    ads, i = [], 0
+    while i < len(payload):
+        n = payload[i]
+        if n == 0 or i + 1 + n > len(payload):
+            err.append("AD length %u at %u exceeds payload" % (n, i))
+            return ads
+        ads.append((payload[i + 1], payload[i + 2:i + 1 + n]))
+        i += 1 + n
+    if connectable and (not ads or ads[0][0] != 0x01):
+        err.append("connectable adv without flags")
+    return ads
+
+
+def parse_bthome_v2(sd, key, err, meta):
+    info, data = sd[0], sd[1:]
+    if info >> 5 != 2 or info & 0x1A:
+        err.append("info byte 0x%02X" % info)
+    if info & 0x01:
+        if len(data) < BTHOME_CRYPT_OVERHEAD + 1:
+            err.append("encrypted data too short")
+            return {}
+        meta["cnt"] = int.from_bytes(data[-8:-4], "little")
+        try:
+            data, _ = ccm(key, bthome_nonce(meta["cnt"], info), b"", data[:-8], decrypt=True, tag=data[-4:])
+        except ValueError as e:
+            err.append(str(e))
+            return {}
+    res, i, last = {}, 0, -1
+    while i < len(data):
+        oid = data[i]
+        if oid not in BTHOME_SIZES:
+            err.append("unknown object 0x%02X" % oid)
+            return res
+        if oid < last:
+            err.append("object 0x%02X after 0x%02X (not ascending)" % (oid, last))
+        last = oid
+        size = BTHOME_SIZES[oid]
+        if size is None:
+            size, i = data[i + 1], i + 1
+        if i + 1 + size > len(data):
+            err.append("object 0x%02X truncated" % oid)
+            return res
+        val = data[i + 1:i + 1 + size]
+        res[BTHOME_NAMES.get(oid, "0x%02X" % oid)] = int.from_bytes(val, "little", signed=oid == 0x02) \
+            if oid != 0x53 else val.decode()
+        i += 1 + size
+    return res
+
+
+def parse_bthome_v1(data, err, meta):
+    res, i = {}, 0
+    while i < len(data):
+        fmt, n = data[i] >> 5, data[i] & 0x1F
+        if n < 2 or i + 1 + n > len(data):
+            err.append("V1 object length %u at %u" % (n, i))
+            return res
+        oid, val = data[i + 1], data[i + 2:i + 1 + n]
+        if BTHOME_SIZES.get(oid) != len(val):
+            err.append("V1 object 0x%02X size %u" % (oid, len(val)))
+        res[BTHOME_NAMES.get(oid, "0x%02X" % oid)] = int.from_bytes(val, "little", signed=fmt == 1)
+        i += 1 + n
+    return res
+
+
+def parse_xiaomi(sd, key, err, meta):
+    flags = int.from_bytes(sd[0:2], "little")
+    if flags & 0x0008:
+        meta["cnt"] = sd[4] | int.from_bytes(sd[-7:-4], "little") << 8
+        try:
+            data = decrypt_frame(key, MAC, sd)
+        except ValueError as e:
+            err.append(str(e))
+            return {}
+    else:
+        meta["pid"], data = sd[4], sd[5:]
+    names = {0x1004: "temp", 0x1008: "moist", 0x100A: "bat"}
+    res, i = {}, 0
+    while i < len(data):
+        if i + 3 > len(data) or i + 3 + data[i + 2] > len(data):
+            err.append("MiBeacon object truncated at %u" % i)
+            return res
+        oid, n = int.from_bytes(data[i:i + 2], "little"), data[i + 2]
+        res[names.get(oid, "0x%04X" % oid)] = int.from_bytes(data[i + 3:i + 3 + n], "little", signed=oid == 0x1004)
+        i += 3 + n
+    return res
+
+
+def check(fmt, payload, expect, key, connectable, meta):
+    err = []
+    ads = parse_ad(payload, connectable, err)
+    sds = [d for t, d in ads if t == 0x16]
+    if len(sds) != 1:
+        return ["%u service data structures" % len(sds)]
+    uuid, sd = int.from_bytes(sds[0][:2], "little"), sds[0][2:]
+    want = {"bthome_v2": 0xFCD2, "devinfo": 0xFCD2, "bthome_v1": 0x181C, "xiaomi": 0xFE95}[fmt]
+    if uuid != want:
+        return ["uuid 0x%04X" % uuid]
+    if uuid == 0xFCD2:
+        got = parse_bthome_v2(sd, key, err, meta)
+    elif uuid == 0x181C:
+        got = parse_bthome_v1(sd, err, meta)
+    else:
+        got = parse_xiaomi(sd, key, err, meta)
+    if fmt == "devinfo" and got.get("text") and expect["text"].startswith(got["text"]):
+        expect = dict(expect, text=got["text"])  # truncated to fit
+    if got != expect:
+        err.append("decoded %s, expected %s" % (got, expect))
+    return err
+
+
+def expected(fmt, values, key, connectable, minimal, slow_due):
+    if fmt == "xiaomi":
+        res = {n: trunc_div(values[n], d) for n, _, d in OBJ_XIAOMI if n in values}
+        if key and flags_expected(connectable, minimal):
+            res.pop(XIAOMI_FLAGS_DROP, None)
+        return res
+    if fmt == "devinfo":
+        major, minor, patch = firmware_version()
+        txt = ".".join(map(str, MCU_VERSION[:3])) + "/" + ".".join(map(str, MCU_VERSION[3:]))
+        res = {"text": txt, "fw": (major << 16) | (minor << 8) | patch}
+        if not key:
+            res["pid"] = values["pid"]
+        return res
+    if fmt == "bthome_v1":  # no packet id (not counted in V1)
+        values = {n: v for n, v in values.items() if n != "pid"}
+    return {n: values[n] for n in objects_mask(values, key if fmt == "bthome_v2" else None, minimal, slow_due)}
+
+
+def flags_expected(connectable, minimal):
+    """adv flags: always on connectable adv, dropped on non-connectable adv with the minimal airtime option"""
+    return connectable or not minimal
+
+
+def main():
+    ap = argparse.ArgumentParser(description="sensor data adv frames against receiver rules")
+    ap.add_argument("--check", action="store_true", help="check the receiver rules")
+    ap.add_argument("--cc", default="cc", help="C compiler for the host build of the firmware")
+    args = ap.parse_args()
+
+    cases, requests = [], []
+    for fmt, key, connectable, minimal, slow_due, values in itertools.product(
+            ("bthome_v2", "bthome_v1", "xiaomi", "mixed", "devinfo"), (None, KEY), (False, True), (False, True),
+            (True, False), VALUES):
+        if (fmt == "bthome_v1" and key) or (not minimal and not slow_due):
+            continue
+        cnt = 0x12345 + len(cases)
+        cases.append((fmt, key, connectable, minimal, slow_due, values, cnt))
+        requests.append("%s %s %u %u %u %u %s %u %s" % (
+            "bthome_v2" if fmt == "devinfo" else fmt, key.hex() if key else "-", connectable, minimal, slow_due,
+            fmt == "devinfo", " ".join(str(values[n]) if n in values and (n, fmt) != ("pid", "bthome_v1") else "-"
+                                       for n in OBJ_NAMES), cnt,
+            bytes(MCU_VERSION).hex()))
+    frames = build_frames(requests, MAC, args.cc)
+    if frames is None:
+        print("host build: %s not found" % args.cc)
+        return 1
+
+    fail = 0
+    for (fmt, key, connectable, minimal, slow_due, values, cnt), (payload, alt) in zip(cases, frames):
+        opts = "%s%s%s%s" % ("enc " if key else "", "conn " if connectable else "",
+                             "minimal " if minimal else "", "" if slow_due else "slow-skip ")
+        out = [("bthome_v2", payload), ("xiaomi", alt)] if fmt == "mixed" else [(fmt, payload)]
+        metas = []
+        for ofmt, p in out:
+            meta, err = {}, []
+            if p == "error":
+                err = ["firmware length error (not sent)"]
+            elif p is None:
+                err = ["no frame"]
+            else:
+                err = check(ofmt, p, expected(ofmt, values, key, connectable, minimal, slow_due), key, connectable, meta)
+                if p.startswith(ADV_FLAGS) != flags_expected(connectable, minimal):
+                    err.append("adv flags %s" % ("present" if p.startswith(ADV_FLAGS) else "missing"))
+                if key and meta.get("cnt") != cnt:
+                    err.append("counter 0x%X, expected 0x%X" % (meta.get("cnt", 0), cnt))
+            if fmt == "mixed" and ofmt == "xiaomi" and not key and meta.get("pid") != values["pid"]:
+                err.append("packet id %s, expected %u (BTHome frame)" % (meta.get("pid"), values["pid"]))
+            metas.append(meta)
+            p = p if isinstance(p, bytes) else b""
+            fail += len(err) > 0
+            pdu = 2 + 6 + len(p)
+            name = "mixed/" + ofmt[:2] if fmt == "mixed" else fmt
+            print("%-9s %-28s PDU %2u bytes, %3u us  %s" % (name, opts, pdu, (1 + 4 + pdu + 3) * 8, p.hex()))
+            for e in err:
+                print("  FAIL: %s" % e)
+    print("%u frames, %u failed" % (sum(2 if c[0] == "mixed" else 1 for c in cases), fail))
+    return 1 if args.check and fail else 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""
+CCM fast path check: fixed shape framing against the generic CCM
+
+The BTHome encryption uses the fixed shape fast path of crypt/ccm.c
+(ccm_encrypt_and_tag_fast, ccm_keystream_fast + ccm_encrypt_and_tag_ks):
+13 byte nonce, no additional data, 4 byte tag, max. CCM_FAST_MAXLEN bytes.
+This script checks on fixed vectors that the fast path framing gives the
+same output and tag as the generic aes_ccm_encrypt_and_tag():
+  - Python model of the fast path (B_0 / A_i flags, keystream layout
+    S_0[0..3] S_1 S_2) against the generic CCM (mibeacon_v5.py)
+  - the real crypt/ccm.c, compiled on the host with a software AES in
+    place of the AES engine registers (needs a C compiler)
+MiBeacon V5 (additional data 0x11) is not covered by the fast path, it
+uses aes_ccm_encrypt_and_tag().
+
+Usage:
+  python3 ccm_fast.py                 print the golden vectors
+  python3 ccm_fast.py --check         check model and compiled ccm.c
+  python3 ccm_fast.py --check --cc clang
+"""
+
+import argparse
+import os
+import shutil
+import subprocess
+import tempfile
+
+from fw_host import HOST_AES
+from mibeacon_v5 import aes128_encrypt, ccm
+
+CCM_FAST_MAXLEN = 32
+CCM_FAST_FLAGS_B0 = (((4 - 2) // 2) << 3) | (2 - 1)  # tag_len 4, q 2
+CCM_FAST_FLAGS_CTR = 2 - 1
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "source", "src")
+
+
+def xor(a, b):
+    return bytes(x ^ y for x, y in zip(a, b))
+
+
+def keystream_fast(key, nonce, length):
+    """ccm_keystream_fast(): tag mask S_0 (4 bytes), S_1 .. S_n (full blocks)"""
+    ctr = lambda i: bytes([CCM_FAST_FLAGS_CTR]) + nonce + bytes([0, i])
+    ks = aes128_encrypt(key, ctr(0))[:4]
+    for n in range(0, length, 16):
+        ks += aes128_encrypt(key, ctr(n // 16 + 1))
+    return ks
+
+
+def encrypt_ks(key, nonce, ks, data):
+    """ccm_encrypt_and_tag_ks(): CBC-MAC (zero padding: no xor) + keystream xor"""
+    y = aes128_encrypt(key, bytes([CCM_FAST_FLAGS_B0]) + nonce + bytes([0, len(data)]))
+    for n in range(0, len(data), 16):
+        blk = data[n:n + 16]
+        y = aes128_encrypt(key, xor(y[:len(blk)], blk) + y[len(blk):])
+    return xor(data, ks[4:]), xor(y[:4], ks[:4])
+
+
+def encrypt_fast(key, nonce, data):
+    """ccm_encrypt_and_tag_fast(): same framing, keystream per block"""
+    return encrypt_ks(key, nonce, keystream_fast(key, nonce, len(data)), data)
+
+
+def bthome_nonce(mac, infoflags, cnt):
+    """ble_bthome_nonce(): mac (6, big endian) uuid16 (2) infoflags (1) counter (4)"""
+    return bytes.fromhex(mac.replace(":", "")) + b"\xd2\xfc" + bytes([infoflags]) + cnt.to_bytes(4, "little")
+
+
+# golden vectors: key, nonce, plain data (lengths 0 .. CCM_FAST_MAXLEN, block borders)
+KEY1 = "231d39c1d7cc1ab1aee224cd096db932"
+KEY2 = "00112233445566778899aabbccddeeff"
+GOLDEN = [
+    (KEY1, bthome_nonce("54:48:E6:8F:80:A5", 0x41, 0x00000001), ""),
+    (KEY1, bthome_nonce("54:48:E6:8F:80:A5", 0x41, 0x00000001), "01"),
+    (KEY1, bthome_nonce("54:48:E6:8F:80:A5", 0x41, 0x00000002), "0264" "02e109" "2f37"),
+    (KEY1, bthome_nonce("54:48:E6:8F:80:A5", 0x45, 0x00012345), bytes(range(15)).hex()),
+    (KEY1, bthome_nonce("54:48:E6:8F:80:A5", 0x45, 0x00012345), bytes(range(16)).hex()),
+    (KEY2, bthome_nonce("A4:C1:38:00:11:22", 0x41, 0xFFFFFFFE), bytes(range(17)).hex()),
+    (KEY2, bthome_nonce("A4:C1:38:00:11:22", 0x41, 0xFFFFFFFF), bytes(range(31)).hex()),
+    (KEY2, bytes(0xA0 + i for i in range(13)), bytes(range(CCM_FAST_MAXLEN)).hex()),  # APP_CCM_DEBUG_EN
+]
+GOLDEN_OUT = [
+    "68556c07",
+    "048e8417ba",
+    "cf1109030ece59328d4198",
+    "b3b0f326d9ae06cc5acf55de86d5cd7e295f19",
+    "b3b0f326d9ae06cc5acf55de86d5cdf3c52985e9",
+    "ff8108e997930f4560e41f0fc5b8c536f45352b5b9",
+    "db737c5c171e97dba24f87f65911034acaafcf840238329ba8389a9be85a5092dba0ee",
+    "b8bf81195e40d918f25ab1b3bd3e77e0ef45e0a04a76a55bf75557358a8706d567b31943",
+]
+
+# host build of crypt/ccm.c: AES engine registers on a software AES
+HOST_HDR = r"""
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+typedef unsigned char u8;
+typedef unsigned int u32;
+#define _attribute_ram_code_
+void aes_sw(const u8 *key, const u8 *in, u8 *out);
+static inline void aes_encrypt(u8 *key, u8 *in, u8 *out) { aes_sw(key, in, out); }
+#define FLD_AES_CTRL_CODEC_TRIG     0x01
+#define FLD_AES_CTRL_DATA_FEED      0x02
+#define FLD_AES_CTRL_CODEC_FINISHED 0x04
+extern u8 aes_key[16];
+extern u32 aes_data[8];
+extern int aes_data_idx;
+u32 *aes_ctrl(void);
+#define reg_aes_ctrl   (*aes_ctrl())
+#define reg_aes_key(i) aes_key[i]
+#define reg_aes_data   aes_data[aes_data_idx++]
+"""
+
+HOST_MAIN = r"""
+#include <stdio.h>
+#include "ccm.c"
+
+%(aes)s
+
+/* stdin: key nonce data (hex, "-": empty), stdout: generic fast ks (data + tag) */
+int main(void)
+{
+    char k[64], iv[64], d[128];
+    u8 key[16], nonce[13], data[CCM_FAST_MAXLEN], out[CCM_FAST_MAXLEN], tag[4], ks[CCM_FAST_KS_LEN];
+    while (scanf("%%63s %%63s %%127s", k, iv, d) == 3) {
+        int n = (d[0] == '-') ? 0 : unhex(d, data);
+        unhex(k, key); unhex(iv, nonce);
+        aes_ccm_encrypt_and_tag(key, nonce, 13, NULL, 0, data, n, out, tag, 4);
+        hex(out, n); hex(tag, 4); printf(" ");
+        ccm_encrypt_and_tag_fast(key, nonce, data, n, out, tag);
+        hex(out, n); hex(tag, 4); printf(" ");
+        ccm_keystream_fast(key, nonce, CCM_FAST_MAXLEN, ks); /* keystream for a longer length */
+        ccm_encrypt_and_tag_ks(key, nonce, ks, data, n, out, tag);
+        hex(out, n); hex(tag, 4); printf("\n");
+    }
+    return 0;
+}
+"""
+
+
+def check_host_build(cc):
+    """compile crypt/ccm.c on the host, returns the results per golden vector or None"""
+    if not shutil.which(cc):
+        print("host build: %s not found, skipped" % cc)
+        return None
+    from mibeacon_v5 import SBOX
+    with tempfile.TemporaryDirectory() as tmp:
+        os.makedirs(os.path.join(tmp, "drivers", "8258"))
+        for name in ("tl_common.h", "drivers.h", os.path.join("drivers", "8258", "aes.h")):
+            with open(os.path.join(tmp, name), "w") as f:
+                f.write(HOST_HDR if name == "tl_common.h" else "")
+        with open(os.path.join(tmp, "main.c"), "w") as f:
+            f.write(HOST_MAIN % {"aes": HOST_AES % {"sbox": ", ".join("0x%02x" % v for v in SBOX)}})
+        exe = os.path.join(tmp, "ccm_host")
+        cmd = [cc, "-std=gnu99", "-fgnu89-inline", "-O1", "-w", "-I", tmp,
+               "-I", os.path.join(SRC_DIR, "crypt"), "-o", exe, os.path.join(tmp, "main.c")]
+        subprocess.run(cmd, check=True)
+        stdin = "".join("%s %s %s\n" % (key, nonce.hex(), data or "-") for key, nonce, data in GOLDEN)
+        res = subprocess.run([exe], input=stdin, capture_output=True, text=True, check=True)
+    return [line.split() for line in res.stdout.splitlines()]
+
+
+def main():
+    ap = argparse.ArgumentParser(description="CCM fast path check against the generic CCM")
+    ap.add_argument("--check", action="store_true", help="check the golden vectors")
+    ap.add_argument("--cc", default="cc", help="C compiler for the host build of crypt/ccm.c")
+    args = ap.parse_args()
+
+    host = check_host_build(args.cc) if args.check else None
+    fail = 0
+    for i, ((key, nonce, data), expect) in enumerate(zip(GOLDEN, GOLDEN_OUT)):
+        k, d = bytes.fromhex(key), bytes.fromhex(data)
+        generic = b"".join(ccm(k, nonce, b"", d))
+        fast = b"".join(encrypt_fast(k, nonce, d))
+        ks = b"".join(encrypt_ks(k, nonce, keystream_fast(k, nonce, CCM_FAST_MAXLEN), d))
+        ok = generic.hex() == expect and fast == generic and ks == generic
+        if host is not None:
+            ok = ok and host[i] == [expect] * 3
+        fail += not ok
+        print("key %s nonce %s len %u" % (key, nonce.hex(), len(d)))
+        print("  out %s%s" % (generic.hex(), "" if not args.check else (" ok" if ok else " FAIL")))
+    if host is not None:
+        print("host build of crypt/ccm.c: generic, fast, keystream %s" % ("FAIL" if fail else "ok"))
+    return 1 if args.check and fail else 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
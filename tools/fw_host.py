@@ -0,0 +1,284 @@
+#!/usr/bin/env python3
+"""
+Host build of the firmware adv data builders
+
+Compiles source/src/app_ble.c and crypt/ccm.c on the host (stub SDK headers,
+AES engine registers on a software AES) and runs the real sensor data
+builders (ble_build_adv_sensordata: BTHome V2, V1, Xiaomi, mixed, device
+info packet). Used by adv_frames.py and mibeacon_v5.py to check the
+firmware output with independent receiver side parsers.
+
+Only the functions reachable from the host driver are linked
+(-ffunction-sections, --gc-sections), the rest of the SDK is not needed.
+
+Usage:
+  python3 fw_host.py "<request>" ...   print the built payloads (hex)
+request (one frame): fmt key conn minimal slow devinfo pid bat temp volt moist cnt mcuver
+  fmt: bthome_v2, bthome_v1, xiaomi, mixed; key: hex or "-"; pid .. moist: value or "-"
+  cnt: next counter value; mcuver: MCU soft + hard version (6 bytes hex)
+reply: payload and alternate payload (mixed) in hex, "-": none, "error": length error
+"""
+
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+SRC_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "source", "src")
+
+# AES engine registers on a software AES (crypt/ccm.c), hex helpers
+HOST_AES = r"""
+static const u8 sbox[256] = { %(sbox)s };
+static u8 xt(u8 x) { return (u8)((x << 1) ^ ((x & 0x80) ? 0x1b : 0)); }
+void aes_sw(const u8 *key, const u8 *in, u8 *out)
+{
+    u8 rk[176], s[16], t[16], rcon = 1; int i, r, c;
+    memcpy(rk, key, 16);
+    for (i = 16; i < 176; i += 4) {
+        u8 w[4] = { rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1] };
+        if (i %% 16 == 0) {
+            u8 w0 = w[0];
+            w[0] = sbox[w[1]] ^ rcon; w[1] = sbox[w[2]]; w[2] = sbox[w[3]]; w[3] = sbox[w0];
+            rcon = xt(rcon);
+        }
+        for (c = 0; c < 4; c++) rk[i + c] = rk[i - 16 + c] ^ w[c];
+    }
+    for (i = 0; i < 16; i++) s[i] = in[i] ^ rk[i];
+    for (r = 1; r <= 10; r++) {
+        for (i = 0; i < 16; i++) t[i] = sbox[s[(i + 4 * (i %% 4)) %% 16]];
+        if (r < 10)
+            for (c = 0; c < 16; c += 4) {
+                u8 x = t[c] ^ t[c + 1] ^ t[c + 2] ^ t[c + 3], a0 = t[c];
+                for (i = 0; i < 4; i++)
+                    t[c + i] ^= x ^ xt(t[c + i] ^ (i < 3 ? t[c + i + 1] : a0));
+            }
+        for (i = 0; i < 16; i++) s[i] = t[i] ^ rk[16 * r + i];
+    }
+    memcpy(out, s, 16);
+}
+
+/* AES engine: 4 words in, FINISHED, 4 words out */
+u8 aes_key[16];
+u32 aes_data[8];
+int aes_data_idx;
+static u32 aes_ctrl_reg;
+u32 *aes_ctrl(void)
+{
+    int i;
+    if (aes_data_idx == 8 || aes_data_idx == 0) {
+        aes_data_idx = 0;
+        aes_ctrl_reg = FLD_AES_CTRL_DATA_FEED;
+    }
+    else if (aes_data_idx == 4) {
+        u8 in[16], out[16];
+        for (i = 0; i < 16; i++) in[i] = (u8)(aes_data[i / 4] >> (8 * (i %% 4)));
+        aes_sw(aes_key, in, out);
+        for (i = 0; i < 4; i++)
+            aes_data[4 + i] = out[4 * i] | (out[4 * i + 1] << 8) | (out[4 * i + 2] << 16) | ((u32) out[4 * i + 3] << 24);
+        aes_ctrl_reg = FLD_AES_CTRL_CODEC_FINISHED;
+    }
+    return &aes_ctrl_reg;
+}
+
+static int unhex(const char *s, u8 *b)
+{
+    int n = 0; unsigned int v;
+    while (s[0] && s[1] && sscanf(s, "%%2x", &v) == 1) { b[n++] = (u8) v; s += 2; }
+    return n;
+}
+
+static void hex(const u8 *b, int n)
+{
+    while (n--) printf("%%02x", *b++);
+}
+"""
+
+# SDK stub headers: types, attributes, the enums and register macros used by app_ble.c and crypt/ccm.c
+HOST_SDK = r"""
+#ifndef HOST_SDK_H
+#define HOST_SDK_H
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+typedef unsigned char u8; typedef signed char s8; typedef unsigned short u16; typedef signed short s16;
+typedef unsigned int u32; typedef signed int s32; typedef unsigned long long u64;
+typedef int bool;
+#define _attribute_ram_code_
+#define _attribute_data_retention_
+#define _attribute_ble_data_retention_
+#define _attribute_packed_ __attribute__((packed))
+#define _attribute_no_inline_
+#define _attribute_aligned_(x) __attribute__((aligned(x)))
+#define BIT(n) (1<<(n))
+#define U16_LO(x) ((x)&0xff)
+#define U16_HI(x) (((x)>>8)&0xff)
+#define U32_BYTE0(x) ((x)&0xff)
+#define U32_BYTE1(x) (((x)>>8)&0xff)
+#define U32_BYTE2(x) (((x)>>16)&0xff)
+#define U32_BYTE3(x) (((x)>>24)&0xff)
+#define CLOCK_SYS_CLOCK_HZ 24000000
+#define CLOCK_SYS_CLOCK_1US 24
+#define CLOCK_16M_SYS_TIMER_CLK_1US 16
+#define CLOCK_16M_SYS_TIMER_CLK_1MS 16000
+#define CLOCK_16M_SYS_TIMER_CLK_1S 16000000
+enum { FLD_AES_CTRL_CODEC_TRIG=1, FLD_AES_CTRL_DATA_FEED=2, FLD_AES_CTRL_CODEC_FINISHED=4 };
+void aes_sw(const u8 *key, const u8 *in, u8 *out);
+static inline void aes_encrypt(u8 *key, u8 *in, u8 *out) { aes_sw(key, in, out); }
+extern u8 aes_key[16];
+extern u32 aes_data[8];
+extern int aes_data_idx;
+u32 *aes_ctrl(void);
+#define reg_aes_ctrl   (*aes_ctrl())
+#define reg_aes_key(i) aes_key[i]
+#define reg_aes_data   aes_data[aes_data_idx++]
+u32 clock_time(void); u8 irq_disable(void); void irq_restore(u8 r);
+enum { ADV_FP_NONE, ADV_INTERVAL_10MS, ADV_INTERVAL_1S, ADV_INTERVAL_20MS, ADV_INTERVAL_30MS, ADV_INTERVAL_35MS,
+ ADV_TYPE_CONNECTABLE_DIRECTED_HIGH_DUTY, ADV_TYPE_CONNECTABLE_DIRECTED_LOW_DUTY, ADV_TYPE_CONNECTABLE_UNDIRECTED,
+ ADV_TYPE_NONCONNECTABLE_UNDIRECTED, ADV_TYPE_SCANNABLE_UNDIRECTED, Authenticated_Pairing_with_Encryption,
+ BLC_ADV_DISABLE, BLC_ADV_ENABLE, BLE_SUCCESS, BLT_ENABLE_ADV_37, BLT_ENABLE_ADV_38, BLT_ENABLE_ADV_39, BLT_ENABLE_ADV_ALL,
+ BLT_EV_FLAG_CONNECT, BLT_EV_FLAG_DATA_LENGTH_EXCHANGE, BLT_EV_FLAG_SCAN_RSP, BLT_EV_FLAG_SUSPEND_ENTER,
+ BLT_EV_FLAG_SUSPEND_EXIT, BLT_EV_FLAG_TERMINATE, Bondable_Mode, CONN_INTERVAL_10MS, CONN_INTERVAL_15MS, CONN_TIMEOUT_4S,
+ DT_APPEARANCE=0x19, DT_COMPLETE_LOCAL_NAME=0x09, DT_FLAGS=0x01, DT_INCOMPLETE_LIST_16BIT_SERVICE_UUID=0x02,
+ GAP_EVT_ATT_EXCHANGE_MTU=0x100, GAP_EVT_GATT_HANDLE_VALUE_CONFIRM, GAP_EVT_SMP_CONN_ENCRYPTION_DONE, GAP_EVT_SMP_PAIRING_BEGIN,
+ GAP_EVT_SMP_PAIRING_FAIL, GAP_EVT_SMP_PAIRING_SUCCESS, GAP_EVT_SMP_SECURITY_PROCESS_DONE, GAP_EVT_SMP_TK_DISPLAY,
+ GAP_EVT_SMP_TK_NUMERIC_COMPARE, GAP_EVT_SMP_TK_REQUEST_OOB, GAP_EVT_SMP_TK_REQUEST_PASSKEY, HCI_ERR_REMOTE_USER_TERM_CONN,
+ IO_CAPABILITY_DISPLAY_ONLY, IO_CAPABILITY_NO_INPUT_NO_OUTPUT, No_Security, OWN_ADDRESS_PUBLIC, PM_WAKEUP_PAD, PM_WAKEUP_TIMER,
+ RF_POWER_N0p97dBm, RF_POWER_N19p27dBm, RF_POWER_N3p03dBm, RF_POWER_N5p03dBm, RF_POWER_N9p89dBm, RF_POWER_P0p04dBm,
+ RF_POWER_P0p90dBm, RF_POWER_P10p01dBm, RF_POWER_P1p99dBm, RF_POWER_P3p01dBm, RF_POWER_P3p94dBm, RF_POWER_P5p13dBm,
+ RF_POWER_P6p14dBm, RF_POWER_P7p02dBm, RF_POWER_P8p13dBm, RF_POWER_P8p97dBm, SecReq_IMM_SEND, SecReq_PEND_SEND,
+ Unauthenticated_Pairing_with_Encryption, MTU_SIZE_SETTING,
+ DEEPSLEEP_MODE_RET_SRAM_LOW16K, DEEPSLEEP_MODE_RET_SRAM_LOW32K, DEEPSLEEP_RETENTION_ADV, DEEPSLEEP_RETENTION_CONN,
+ SUSPEND_ADV, SUSPEND_CONN, SUSPEND_DISABLE };
+typedef int ble_sts_t; typedef int own_addr_type_t; typedef int io_capability_t;
+typedef struct { u8 type; u8 rf_len; u8 advA[6]; u8 data[31]; u32 dma_len; } rf_packet_adv_t;
+typedef struct { u8 peer_addr_type; u8 peer_addr[6]; u8 peer_irk[16]; u8 peer_id_adrType; u8 peer_id_addr[6]; } smp_param_save_t;
+typedef struct { u16 connHandle; u8 bonding; u8 secure_conn; } gap_smp_pairingBeginEvt_t;
+typedef struct { u16 connHandle; u8 bonding; u8 bonding_result; } gap_smp_pairingSuccessEvt_t;
+typedef void (*flash_prot_op_callback_t)(u8, u32, u32);
+int blc_l2cap_packet_receive(u16 conn, u8 *p);
+#endif
+"""
+
+# driver: firmware state from the request, ble_build_adv_sensordata(), payloads out
+HOST_MAIN = r"""
+#include <stdio.h>
+#include "app_ble.c"
+#include "ccm.c"
+%(aes)s
+/* app / SDK functions used by the builders */
+static u8 host_key[16], host_key_on, host_datafmt;
+const u8 *app_config_get_bthome_key(void) { return host_key_on ? host_key : 0; }
+u8 app_config_get_dataformat(void) { return host_datafmt; }
+u8 app_config_get_advoption(u8 opt) { return 1; }
+u32 app_sec_time(void) { return 0; }
+u32 clock_time(void) { return 0; }
+u8 irq_disable(void) { return 0; }
+void irq_restore(u8 r) { }
+void bls_ll_setScanRspData(u8 *data, u8 len) { }
+void app_ble_att_set_bthome_data(const u8 *data, u8 len) { }
+void app_ble_att_set_xiaomi_data(const u8 *data, u8 len) { }
+
+static int value(const char *s, int *v)
+{
+    if (s[0] == '-' && s[1] == 0) return 0;
+    *v = atoi(s);
+    return 1;
+}
+
+static void payload(const u8 *p, int n)
+{
+    if (n > 0) hex(p, n); else printf("-");
+}
+
+int main(void)
+{
+    static const char *fmts[] = { "bthome_v2", "bthome_v1", "xiaomi", "mixed" };
+    static const u8 fmtval[] = { DATAFORMAT_BTHOME_V2, DATAFORMAT_BTHOME_V1, DATAFORMAT_XIAOMI, DATAFORMAT_MIXED };
+    static const u8 objflag[] = { DATA_FLAG_PID, DATA_FLAG_BAT, DATA_FLAG_TEMP, DATA_FLAG_VOLT, DATA_FLAG_MOIST };
+    char fmt[16], key[40], val[5][16], mcuver[16];
+    int conn, minimal, slow, devinfo, v[5], i; unsigned int cnt;
+    unhex("%(mac)s", ble_mac_public);
+    while (scanf("%%15s %%39s %%d %%d %%d %%d %%15s %%15s %%15s %%15s %%15s %%u %%15s", fmt, key, &conn, &minimal, &slow,
+            &devinfo, val[0], val[1], val[2], val[3], val[4], &cnt, mcuver) == 13) {
+        host_datafmt = 0;
+        for (i = 0; i < 4; i++) if (!strcmp(fmt, fmts[i])) host_datafmt = fmtval[i];
+        if (minimal) host_datafmt |= DATAFORMAT_OPT_MINIMAL;
+        host_key_on = (key[0] != '-'); if (host_key_on) unhex(key, host_key);
+        /* fresh build buffer, data changed */
+        ble_adv_payload_idx = 0; ble_advSensorData = ble_adv_payload[0]; ble_advSensorDataLen = 0;
+        ble_adv_connectable = (u8) conn;
+        ble_adv_slow_cnt = slow ? SENSORDATA_MINIMAL_SLOW_CNT - 1 : 0; sensor_data_updated = 0;
+        ble_adv_devinfo = devinfo ? ADV_DEVINFO_PENDING : ADV_DEVINFO_OFF;
+        unhex(mcuver, ble_mcu_version);
+        sensor_data_sendcount = cnt - 1; sensor_data_sendcount_end = cnt + 1;
+        memset(&sensor_data, 0, sizeof(sensor_data));
+        for (i = 0; i < 5; i++)
+            if (value(val[i], &v[i])) sensor_data.flags |= objflag[i];
+        sensor_data.pid = (u8)(v[0] - 1); /* incremented by the builder */
+        sensor_data.batterypercent = (u8) v[1]; sensor_data.temperature = (short) v[2];
+        sensor_data.voltage = (u16) v[3]; sensor_data.moisture = (u16) v[4];
+        sensor_data.flags |= DATA_FLAG_CHANGED;
+        if (ble_build_adv_sensordata() < 0) { printf("error -\n"); continue; }
+        payload(ble_advSensorData, ble_advSensorDataLen); printf(" ");
+        payload(ble_adv_payload_alt[0], ble_adv_payload_alt_len[0]); printf("\n");
+    }
+    return 0;
+}
+"""
+
+HEADERS = ("tl_common.h", "types.h", "compiler.h", "drivers.h", os.path.join("drivers", "8258", "aes.h"),
+           os.path.join("stack", "ble", "ble.h"), os.path.join("stack", "ble", "ble_common.h"),
+           os.path.join("stack", "ble", "service", "ota", "ota.h"),
+           os.path.join("stack", "ble", "service", "ota", "ota_server.h"))
+
+
+def firmware_version():
+    """VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH from app_config.h"""
+    with open(os.path.join(SRC_DIR, "app_config.h"), encoding="latin-1") as f:
+        txt = f.read()
+    return tuple(int(re.search(r"#define\s+VERSION_%s\s+(\d+)" % n, txt).group(1)) for n in ("MAJOR", "MINOR", "PATCH"))
+
+
+def build_frames(requests, mac, cc="cc"):
+    """run the firmware builders, returns (payload, alt payload) per request (None: none, "error": length error),
+    or None if no C compiler"""
+    if not shutil.which(cc):
+        return None
+    from mibeacon_v5 import SBOX
+    aes = HOST_AES % {"sbox": ", ".join("0x%02x" % v for v in SBOX)}
+    with tempfile.TemporaryDirectory() as tmp:
+        for name in HEADERS:
+            os.makedirs(os.path.join(tmp, os.path.dirname(name)), exist_ok=True)
+            with open(os.path.join(tmp, name), "w") as f:
+                f.write(HOST_SDK)
+        with open(os.path.join(tmp, "main.c"), "w") as f:
+            f.write(HOST_MAIN % {"aes": aes, "mac": bytes.fromhex(mac.replace(":", ""))[::-1].hex()})
+        exe = os.path.join(tmp, "fw_host")
+        cmd = [cc, "-std=gnu99", "-fgnu89-inline", "-O1", "-w", "-Wno-error=implicit-function-declaration",
+               "-ffunction-sections", "-fdata-sections", "-Wl,--gc-sections",
+               "-I", tmp, "-I", SRC_DIR, "-I", os.path.join(SRC_DIR, "crypt"), "-o", exe, os.path.join(tmp, "main.c")]
+        subprocess.run(cmd, check=True)
+        res = subprocess.run([exe], input="".join(r + "\n" for r in requests), capture_output=True, text=True, check=True)
+    out = []
+    for line in res.stdout.splitlines():
+        p, alt = line.split()
+        out.append(("error" if p == "error" else None if p == "-" else bytes.fromhex(p),
+                    None if alt == "-" else bytes.fromhex(alt)))
+    return out
+
+
+def main():
+    res = build_frames(sys.argv[1:], "54:48:E6:8F:80:A5")
+    if res is None:
+        print("no C compiler")
+        return 1
+    for req, (p, alt) in zip(sys.argv[1:], res):
+        print("%s: %s %s" % (req, p.hex() if isinstance(p, bytes) else p, alt.hex() if alt else "-"))
+    return 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
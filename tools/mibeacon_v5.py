@@ -0,0 +1,222 @@
+#!/usr/bin/env python3
+"""
+MiBeacon v5 encryption: frame check and decoder
+
+Builds encrypted Xiaomi service data frames (UUID 0xFE95) in Python and
+decrypts captured frames, to check gateways on the host. Pure Python (no
+crypto packages needed). The check compares:
+  - the Python AES-CCM with the RFC 3610 reference vector
+  - the Python frames with the firmware frames (DATAFORMAT_XIAOMI with a
+    bindkey: ble_build_adv_xiaomi and crypt/ccm.c, compiled on the host by
+    fw_host.py, needs a C compiler)
+
+Frame (service data after the UUID):
+  flags (2) devid (2) msgcnt (1) | encrypted objects | ext counter (3) mic (4)
+Nonce: mac (6, little endian) devid (2) msgcnt (1) ext counter (3)
+AES-CCM with add data 0x11, 4 byte tag. msgcnt + ext counter = 32 bit counter.
+
+Usage:
+  python3 mibeacon_v5.py                       print the frames
+  python3 mibeacon_v5.py --check               check the reference and the firmware frames
+  python3 mibeacon_v5.py --key <hex> --mac AA:BB:CC:DD:EE:FF --frame <hex>
+                                               decrypt a frame
+"""
+
+import argparse
+
+SBOX = [
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+]
+
+XIAOMI_DEVICE_ID = 0x0098  # MiFlora HHCCJCY01 (firmware default)
+XIAOMI_FLAGS_V5 = 0x5848   # version 5, auth mode 2, has data, encrypted
+
+
+def xtime(x):
+    return ((x << 1) ^ 0x1b) & 0xFF if x & 0x80 else x << 1
+
+
+def aes128_encrypt(key, block):
+    rk = list(key)
+    rcon = 1
+    for i in range(16, 176, 4):
+        t = rk[i - 4:i]
+        if i % 16 == 0:
+            t = [SBOX[t[1]] ^ rcon, SBOX[t[2]], SBOX[t[3]], SBOX[t[0]]]
+            rcon = xtime(rcon)
+        rk += [rk[i - 16 + j] ^ t[j] for j in range(4)]
+    s = [block[i] ^ rk[i] for i in range(16)]
+    for r in range(1, 11):
+        s = [SBOX[s[(i + 4 * (i % 4)) % 16]] for i in range(16)]  # sub bytes + shift rows
+        if r < 10:  # mix columns
+            for c in range(4):
+                a = s[4 * c:4 * c + 4]
+                x = a[0] ^ a[1] ^ a[2] ^ a[3]
+                s[4 * c:4 * c + 4] = [a[j] ^ x ^ xtime(a[j] ^ a[(j + 1) % 4]) for j in range(4)]
+        s = [s[i] ^ rk[16 * r + i] for i in range(16)]
+    return bytes(s)
+
+
+def ccm(key, nonce, aad, data, tag_len=4, decrypt=False, tag=None):
+    """AES-CCM (RFC 3610), returns (data out, tag)"""
+    q = 15 - len(nonce)
+    ctr = lambda i: bytes([q - 1]) + nonce + i.to_bytes(q, "big")
+    stream = b"".join(aes128_encrypt(key, ctr(i + 1)) for i in range((len(data) + 15) // 16))
+    out = bytes(d ^ s for d, s in zip(data, stream))
+    plain = out if decrypt else data
+    b0 = bytes([(0x40 if aad else 0) | ((tag_len - 2) // 2) << 3 | (q - 1)]) + nonce + len(plain).to_bytes(q, "big")
+    auth = b""
+    if aad:
+        auth = len(aad).to_bytes(2, "big") + aad
+        auth += bytes(-len(auth) % 16)
+    auth += plain + bytes(-len(plain) % 16)
+    y = aes128_encrypt(key, b0)
+    for i in range(0, len(auth), 16):
+        y = aes128_encrypt(key, bytes(a ^ b for a, b in zip(y, auth[i:i + 16])))
+    s0 = aes128_encrypt(key, ctr(0))
+    mic = bytes(a ^ b for a, b in zip(y[:tag_len], s0))
+    if decrypt and mic != tag:
+        raise ValueError("mic mismatch")
+    return out, mic
+
+
+def mac_le(mac):
+    return bytes.fromhex(mac.replace(":", ""))[::-1]
+
+
+def nonce_v5(mac, devid, cnt):
+    return mac_le(mac) + devid.to_bytes(2, "little") + bytes([cnt & 0xFF]) + (cnt >> 8).to_bytes(3, "little")
+
+
+def encrypt_frame(key, mac, cnt, objects, devid=XIAOMI_DEVICE_ID, flags=XIAOMI_FLAGS_V5):
+    enc, mic = ccm(key, nonce_v5(mac, devid, cnt), b"\x11", objects)
+    hdr = flags.to_bytes(2, "little") + devid.to_bytes(2, "little") + bytes([cnt & 0xFF])
+    return hdr + enc + (cnt >> 8).to_bytes(3, "little") + mic
+
+
+def decrypt_frame(key, mac, frame):
+    flags = int.from_bytes(frame[0:2], "little")
+    devid = int.from_bytes(frame[2:4], "little")
+    if not flags & 0x0008:
+        return frame[5:]
+    i = 11 if flags & 0x0010 else 5  # mac included
+    if flags & 0x0020:
+        i += 1  # capability
+    cnt = frame[4] | int.from_bytes(frame[-7:-4], "little") << 8
+    out, _ = ccm(key, nonce_v5(mac, devid, cnt), b"\x11", frame[i:-7], decrypt=True, tag=frame[-4:])
+    return out
+
+
+def objects_text(data):
+    names = {0x1004: ("temperature", 0.1, True), 0x1008: ("moisture", 1, False), 0x100A: ("battery", 1, False)}
+    res, i = [], 0
+    while i + 3 <= len(data):
+        oid, n = int.from_bytes(data[i:i + 2], "little"), data[i + 2]
+        name, scale, signed = names.get(oid, ("0x%04X" % oid, 1, False))
+        res.append("%s=%g" % (name, int.from_bytes(data[i + 3:i + 3 + n], "little", signed=signed) * scale))
+        i += 3 + n
+    return ", ".join(res)
+
+
+# CCM reference: RFC 3610 packet vector #1 (key, nonce, add data, data, tag length, encrypted data + tag)
+CCM_VECTORS = [
+    ("c0c1c2c3c4c5c6c7c8c9cacbcccdcecf", "00000003020100a0a1a2a3a4a5", "0001020304050607",
+     "08090a0b0c0d0e0f101112131415161718191a1b1c1d1e", 8,
+     "588c979a61c663d2f066d0c2c0f989806d5f6b61dac384" "17e8d12cfdf926e0"),
+]
+
+# frame vectors: key, mac, counter, plain objects (temp 0.1C, moisture 1%, battery 1%),
+# checked against the firmware (ble_build_adv_xiaomi, host build by fw_host.py)
+FRAMES = [
+    ("231d39c1d7cc1ab1aee224cd096db932", "54:48:E6:8F:80:A5", 0x00000001,
+     "041002e100" "08100137" "0a100164"),
+    ("231d39c1d7cc1ab1aee224cd096db932", "54:48:E6:8F:80:A5", 0x00012345,
+     "041002e1ff" "08100100" "0a100132"),
+    ("00112233445566778899aabbccddeeff", "A4:C1:38:00:11:22", 0xFFFFFFFE,
+     "0410020000" "08100164"),
+]
+
+
+def firmware_request(key, cnt, objects):
+    """fw_host.py request: encrypted Xiaomi frame, non-connectable minimal airtime (all objects, no adv flags)"""
+    val = {"temp": "-", "moist": "-", "bat": "-"}
+    i = 0
+    while i + 3 <= len(objects):
+        oid, n = int.from_bytes(objects[i:i + 2], "little"), objects[i + 2]
+        v = int.from_bytes(objects[i + 3:i + 3 + n], "little", signed=oid == 0x1004)
+        name, scale = {0x1004: ("temp", 10), 0x1008: ("moist", 100), 0x100A: ("bat", 1)}[oid]
+        val[name] = str(v * scale)  # firmware units: 0.01C, 0.01%, 1%
+        i += 3 + n
+    return "xiaomi %s 0 1 1 0 1 %s %s - %s %u 000000000000" % (key, val["bat"], val["temp"], val["moist"], cnt)
+
+
+def firmware_frames(cc):
+    """service data of the firmware frames per FRAMES entry, or None (no C compiler)"""
+    from fw_host import build_frames
+    res = [None] * len(FRAMES)
+    for mac in sorted(set(v[1] for v in FRAMES)):
+        idx = [i for i, v in enumerate(FRAMES) if v[1] == mac]
+        out = build_frames([firmware_request(FRAMES[i][0], FRAMES[i][2], bytes.fromhex(FRAMES[i][3])) for i in idx],
+                           mac, cc)
+        if out is None:
+            return None
+        for i, (payload, _) in zip(idx, out):
+            res[i] = payload[4:] if isinstance(payload, bytes) else b""  # after length, AD type, UUID
+    return res
+
+
+def main():
+    ap = argparse.ArgumentParser(description="MiBeacon v5 frame check / decoder")
+    ap.add_argument("--check", action="store_true", help="check the CCM reference and the firmware frames")
+    ap.add_argument("--cc", default="cc", help="C compiler for the host build of the firmware")
+    ap.add_argument("--key", help="bindkey (hex)")
+    ap.add_argument("--mac", help="device MAC AA:BB:CC:DD:EE:FF")
+    ap.add_argument("--frame", help="service data after the UUID (hex)")
+    args = ap.parse_args()
+
+    if args.frame:
+        plain = decrypt_frame(bytes.fromhex(args.key), args.mac, bytes.fromhex(args.frame))
+        print("plain %s: %s" % (plain.hex(), objects_text(plain)))
+        return 0
+    fail = 0
+    for key, nonce, aad, data, tag_len, expect in CCM_VECTORS:
+        out, mic = ccm(bytes.fromhex(key), bytes.fromhex(nonce), bytes.fromhex(aad), bytes.fromhex(data), tag_len)
+        ok = (out + mic).hex() == expect
+        fail += not ok
+        print("CCM reference (RFC 3610) key %s nonce %s" % (key, nonce))
+        print("  out %s%s" % ((out + mic).hex(), "" if not args.check else (" ok" if ok else " FAIL")))
+    fw = firmware_frames(args.cc) if args.check else None
+    if args.check and fw is None:
+        print("host build: %s not found, firmware frames not checked" % args.cc)
+    for i, (key, mac, cnt, objects) in enumerate(FRAMES):
+        frame = encrypt_frame(bytes.fromhex(key), mac, cnt, bytes.fromhex(objects))
+        plain = decrypt_frame(bytes.fromhex(key), mac, frame)
+        ok = plain.hex() == objects and (fw is None or fw[i] == frame)
+        fail += not ok
+        print("key %s mac %s cnt 0x%08X" % (key, mac, cnt))
+        print("  plain %s (%s)" % (objects, objects_text(bytes.fromhex(objects))))
+        print("  frame %s%s" % (frame.hex(), "" if not args.check else (" ok" if ok else " FAIL")))
+        if fw is not None and fw[i] != frame:
+            print("  firmware %s" % fw[i].hex())
+    if fw is not None:
+        print("firmware frames (host build of ble_build_adv_xiaomi): %s" % ("FAIL" if fail else "ok"))
+    return 1 if args.check and fail else 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Energy comparison: continuous sensor data advertising vs. push mode
+
+Estimates the average current and the battery life of the SGS01 BLE module
+(TLSR825x) for the device modes "measure noconn" (continuous advertising)
+and "measure push" (directed adv + connection + notify on data change),
+depending on the data change rate.
+
+Usage:
+  python3 push_energy.py [--interval 8] [--pdu 31] [--changes 1,4,12,60]
+                         [--battery 1000] [--txdbm 3]
+
+All currents/times are rough TLSR825x values (datasheet, power profiler
+measurements), adjust them for your hardware/gateway setup.
+"""
+
+import argparse
+
+# TLSR825x typical values
+I_SLEEP_UA = 1.8        # deep sleep with retention (uA)
+I_RX_MA = 5.3           # RX (mA)
+I_TX_MA = {-10: 3.3, 0: 4.8, 3: 6.2, 10: 16.0}  # TX by power level (mA)
+I_MCU_MA = 2.0          # MCU active (wake up, stack, app loop)
+T_WAKEUP_US = 1200      # wake up + stack + app loop per event (us)
+T_IFS_US = 150          # inter frame space
+T_BYTE_US = 8           # 1M PHY
+
+
+def tx_current(txdbm):
+    levels = sorted(I_TX_MA)
+    for lvl in levels:
+        if txdbm <= lvl:
+            return I_TX_MA[lvl]
+    return I_TX_MA[levels[-1]]
+
+
+def pdu_time_us(payload_len):
+    # preamble 1, access address 4, header 2, adv address 6, payload, crc 3
+    return (1 + 4 + 2 + 6 + payload_len + 3) * T_BYTE_US
+
+
+def adv_event_charge_uc(payload_len, txdbm, channels=3, scanrsp=False):
+    """charge of one adv event (uC)"""
+    t_tx = pdu_time_us(payload_len) * channels
+    t_rx = (T_IFS_US + 80) * channels if scanrsp else 0
+    q = t_tx * tx_current(txdbm) + t_rx * I_RX_MA + T_WAKEUP_US * I_MCU_MA
+    return q / 1000.0  # mA * us = nC -> uC
+
+
+def conn_event_charge_uc(txdbm, rx_bytes=0, tx_bytes=0):
+    """charge of one connection event (uC): master packet + slave response"""
+    t_rx = (2 + 4 + 2 + rx_bytes + 3) * T_BYTE_US + 100  # rx window widening
+    t_tx = (2 + 4 + 2 + tx_bytes + 3) * T_BYTE_US
+    q = t_rx * I_RX_MA + t_tx * tx_current(txdbm) + (T_WAKEUP_US / 2 + T_IFS_US) * I_MCU_MA
+    return q / 1000.0
+
+
+def push_charge_uc(txdbm, adv_events=2, conn_events=14, notify_bytes=20):
+    """charge of one push: directed high duty adv, connection setup,
+    encryption start (bonded), notification, terminate"""
+    q_adv = adv_events * adv_event_charge_uc(0, txdbm)  # directed adv: no payload
+    q_conn = conn_events * conn_event_charge_uc(txdbm)
+    q_data = conn_event_charge_uc(txdbm, tx_bytes=4 + 3 + notify_bytes)  # l2cap + att header
+    return q_adv + q_conn + q_data
+
+
+def avg_current_ua(charge_per_hour_uc):
+    return I_SLEEP_UA + charge_per_hour_uc / 3600.0
+
+
+def battery_days(i_ua, capacity_mah):
+    return capacity_mah * 1000.0 / i_ua / 24.0
+
+
+def main():
+    ap = argparse.ArgumentParser(description="SGS01 adv vs. push energy comparison")
+    ap.add_argument("--interval", type=float, default=8.0, help="adv interval noconn (sec)")
+    ap.add_argument("--pdu", type=int, default=24, help="adv payload length (bytes)")
+    ap.add_argument("--changes", default="1,2,4,12,30,60,120", help="data changes per hour (list)")
+    ap.add_argument("--heartbeat", type=float, default=30.0, help="push heartbeat (min)")
+    ap.add_argument("--battery", type=float, default=1000.0, help="battery capacity (mAh)")
+    ap.add_argument("--txdbm", type=int, default=3, help="TX power (dBm)")
+    ap.add_argument("--connevents", type=int, default=14, help="connection events per push")
+    args = ap.parse_args()
+
+    adv_per_hour = 3600.0 / args.interval
+    i_adv = avg_current_ua(adv_per_hour * adv_event_charge_uc(args.pdu, args.txdbm))
+    q_push = push_charge_uc(args.txdbm, conn_events=args.connevents)
+
+    print("TX %d dBm, adv interval %.1f s, payload %u bytes, push %.1f uC" %
+          (args.txdbm, args.interval, args.pdu, q_push))
+    print("%10s %14s %14s %10s %10s  %s" % ("changes/h", "adv avg uA", "push avg uA", "adv days", "push days", "better"))
+    for c in [float(x) for x in args.changes.split(",")]:
+        pushes = max(c, 60.0 / args.heartbeat)
+        i_push = avg_current_ua(pushes * q_push)
+        print("%10.1f %14.2f %14.2f %10.0f %10.0f  %s" % (
+            c, i_adv, i_push,
+            battery_days(i_adv, args.battery), battery_days(i_push, args.battery),
+            "push" if i_push < i_adv else "adv"))
+    # break even
+    breakeven = adv_per_hour * adv_event_charge_uc(args.pdu, args.txdbm) / q_push
+    print("break even: %.1f data changes per hour" % breakeven)
+
+
+if __name__ == "__main__":
+    main()